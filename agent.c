@@ -0,0 +1,486 @@
+/*
+ * Copyright 2013
+ *  Steven Maresca <steve@zentific.com>
+ *  Zentific LLC
+ *
+ * agent:
+ *  Opt-in resident helper thread for targets that are queried constantly.
+ *
+ *  The code in the "ptmx_agent" section below is copied into a private
+ *  mapping of the target (one ptrace stop, via mytrace) and started there
+ *  as an extra thread with clone(). It shares the target's fd table and
+ *  answers TIOCGPTN/TCGETS on an abstract unix socket, so later queries
+ *  need no ptrace stop at all. It only talks to root or to the uid that
+ *  installed it, and we only believe a listener that SO_PEERCRED says is
+ *  the target itself: the abstract name is free for anyone to bind first.
+ *
+ *  That code runs without libc, relocations or TLS: raw syscalls only, no
+ *  string literals, no calls out of the section. x86_64 only.
+ *
+ *  Removal asks the thread to exit, then unmaps its pages with one more
+ *  short stop.
+ */
+
+#define _GNU_SOURCE             /* struct ucred */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "ptmx_resolve.h"
+#include "mytrace.h"
+
+#define AGENT_OP_TIOCGPTN   1
+#define AGENT_OP_TCGETS     2
+#define AGENT_OP_INFO       3
+#define AGENT_OP_QUIT       4
+
+#define AGENT_STACK_SIZE    (128 * 1024)
+#define AGENT_PARAM_SIZE    4096
+
+/* a request is one write: a client this slow is stuck or hostile */
+#define AGENT_CLIENT_USEC   500000
+
+/*
+ * The agent's mapping: code (r-x), params (rw-), a guard page (---), then
+ * the stack (rw-). The thread runs on the upper half of the stack; the
+ * entry stub, on the hijacked thread, borrows the lower half.
+ */
+
+/* lives at the start of the writable part of the agent's mapping */
+struct agent_params {
+    long base, len;             /* the whole mapping, for removal */
+    unsigned int uid;           /* besides root, who may talk to us */
+    int addrlen;
+    struct sockaddr_un addr;
+};
+
+struct agent_req {
+    int op;
+    int fd;
+};
+
+struct agent_rep {
+    long ret;                   /* syscall result, -errno on failure */
+    long tid, base, len;        /* AGENT_OP_INFO */
+    union {
+        int pts;
+        struct termios tos;
+    } u;
+};
+
+static void agent_sockaddr(long pid, struct sockaddr_un *addr, int *addrlen) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    /* abstract: leading NUL, nothing left behind in the target's fs */
+    *addrlen = offsetof(struct sockaddr_un, sun_path) + 1 +
+        snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+                 "ptmx_resolve/agent/%ld", pid);
+}
+
+#if defined __x86_64__
+
+/*
+ * XXX: everything from here to the matching #else is copied into the
+ * target. Keep it self-contained.
+ */
+
+#if defined __has_attribute
+#   if __has_attribute(no_stack_protector)
+#       define AGENT_NOSSP __attribute__((no_stack_protector))
+#   endif
+#endif
+#ifndef AGENT_NOSSP
+#   define AGENT_NOSSP
+#endif
+
+#define AGENT __attribute__((section("ptmx_agent"), used, noinline)) AGENT_NOSSP
+#define AGENT_INLINE static inline __attribute__((always_inline))
+
+#define AGENT_X(x) #x
+#define AGENT_STR(x) AGENT_X(x)
+
+#define AGENT_CLONE_FLAGS (CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND \
+                           | CLONE_THREAD | CLONE_SYSVSEM)
+
+AGENT_INLINE long agent_syscall(long n, long a, long b, long c, long d,
+                                long e) {
+    register long r10 __asm__("r10") = d;
+    register long r8 __asm__("r8") = e;
+    long ret;
+
+    __asm__ volatile ("syscall"
+                      : "=a"(ret)
+                      : "a"(n), "D"(a), "S"(b), "d"(c), "r"(r10), "r"(r8)
+                      : "rcx", "r11", "memory");
+    return ret;
+}
+
+/* a plain loop: a memset() the compiler might turn it into is not here */
+AGENT_INLINE void agent_zero(void *p, unsigned long n) {
+    volatile char *c = p;
+
+    while (n--)
+        *c++ = 0;
+}
+
+void ptmx_agent_main(struct agent_params *p)
+    __attribute__((visibility("hidden")));
+
+AGENT void ptmx_agent_main(struct agent_params *p) {
+    unsigned long all = ~0UL;
+    struct agent_req req;
+    struct agent_rep rep;
+    struct timeval tv;
+    struct ucred cred;
+    socklen_t credlen;
+    long s, c, n;
+
+    /* signals are for the target's own threads */
+    agent_syscall(SYS_rt_sigprocmask, SIG_BLOCK, (long)&all, 0, sizeof(all), 0);
+
+    s = agent_syscall(SYS_socket, AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, 0, 0);
+    if (s < 0)
+        return;
+    if (agent_syscall(SYS_bind, s, (long)&p->addr, p->addrlen, 0, 0) < 0
+        || agent_syscall(SYS_listen, s, 4, 0, 0, 0) < 0) {
+        agent_syscall(SYS_close, s, 0, 0, 0, 0);
+        return;
+    }
+
+    for (;;) {
+        c = agent_syscall(SYS_accept4, s, 0, 0, SOCK_CLOEXEC, 0);
+        if (c < 0)
+            continue;
+
+        credlen = sizeof(cred);
+        if (agent_syscall(SYS_getsockopt, c, SOL_SOCKET, SO_PEERCRED,
+                          (long)&cred, (long)&credlen) < 0
+            || (cred.uid != 0 && cred.uid != p->uid)) {
+            agent_syscall(SYS_close, c, 0, 0, 0, 0);
+            continue;
+        }
+
+        /* clients are served one at a time: one that never sends, or
+         * never reads its reply, must not hold up everybody else */
+        tv.tv_sec = 0;
+        tv.tv_usec = AGENT_CLIENT_USEC;
+        if (agent_syscall(SYS_setsockopt, c, SOL_SOCKET, SO_RCVTIMEO,
+                          (long)&tv, sizeof(tv)) < 0
+            || agent_syscall(SYS_setsockopt, c, SOL_SOCKET, SO_SNDTIMEO,
+                             (long)&tv, sizeof(tv)) < 0) {
+            agent_syscall(SYS_close, c, 0, 0, 0, 0);
+            continue;
+        }
+
+        for (;;) {
+            n = agent_syscall(SYS_read, c, (long)&req, sizeof(req), 0, 0);
+            if (n != sizeof(req))
+                break;
+
+            agent_zero(&rep, sizeof(rep));
+            if (req.op == AGENT_OP_TIOCGPTN) {
+                rep.ret = agent_syscall(SYS_ioctl, req.fd, TIOCGPTN,
+                                        (long)&rep.u.pts, 0, 0);
+            } else if (req.op == AGENT_OP_TCGETS) {
+                rep.ret = agent_syscall(SYS_ioctl, req.fd, TCGETS,
+                                        (long)&rep.u.tos, 0, 0);
+            } else if (req.op == AGENT_OP_INFO) {
+                rep.tid = agent_syscall(SYS_gettid, 0, 0, 0, 0, 0);
+                rep.base = p->base;
+                rep.len = p->len;
+            } else if (req.op == AGENT_OP_QUIT) {
+                agent_syscall(SYS_write, c, (long)&rep, sizeof(rep), 0, 0);
+                agent_syscall(SYS_close, c, 0, 0, 0, 0);
+                agent_syscall(SYS_close, s, 0, 0, 0, 0);
+                return;
+            } else {
+                rep.ret = -EINVAL;
+            }
+
+            agent_syscall(SYS_write, c, (long)&rep, sizeof(rep), 0, 0);
+        }
+        agent_syscall(SYS_close, c, 0, 0, 0, 0);
+    }
+}
+
+/*
+ * Entry point, run by mytrace_call() on the hijacked thread with
+ * rdi = params and rsi = top of the agent's stack. All signals are blocked
+ * around clone(), so the new thread starts with them blocked and no
+ * handler of the target ever runs on its stack; the hijacked thread gets
+ * its own mask back and traps straight back to us with the new tid (or
+ * -errno) in rax.
+ */
+__asm__(
+    "   .pushsection ptmx_agent, \"ax\", @progbits\n"
+    "   .globl ptmx_agent_entry\n"
+    "   .hidden ptmx_agent_entry\n"
+    "ptmx_agent_entry:\n"
+    "   mov %rdi, %r12\n"
+    "   mov %rsi, %r13\n"
+    "   pushq $-1\n"
+    "   mov %rsp, %rsi\n"
+    "   sub $8, %rsp\n"
+    "   mov %rsp, %rdx\n"
+    "   mov $" AGENT_STR(SIG_SETMASK) ", %edi\n"
+    "   mov $8, %r10d\n"
+    "   mov $" AGENT_STR(SYS_rt_sigprocmask) ", %eax\n"
+    "   syscall\n"
+    "   mov $" AGENT_STR(AGENT_CLONE_FLAGS) ", %edi\n"
+    "   mov %r13, %rsi\n"
+    "   xor %edx, %edx\n"
+    "   xor %r10d, %r10d\n"
+    "   xor %r8d, %r8d\n"
+    "   mov $" AGENT_STR(SYS_clone) ", %eax\n"
+    "   syscall\n"
+    "   test %rax, %rax\n"
+    "   jnz 1f\n"
+    "   mov %r12, %rdi\n"
+    "   and $-16, %rsp\n"
+    "   call ptmx_agent_main\n"
+    "   mov $" AGENT_STR(SYS_exit) ", %eax\n"
+    "   xor %edi, %edi\n"
+    "   syscall\n"
+    "1: mov %rax, %r14\n"
+    "   mov $" AGENT_STR(SIG_SETMASK) ", %edi\n"
+    "   mov %rsp, %rsi\n"
+    "   xor %edx, %edx\n"
+    "   mov $8, %r10d\n"
+    "   mov $" AGENT_STR(SYS_rt_sigprocmask) ", %eax\n"
+    "   syscall\n"
+    "   mov %r14, %rax\n"
+    "   int3\n"
+    "   .popsection\n"
+);
+
+extern char __start_ptmx_agent[], __stop_ptmx_agent[];
+extern char ptmx_agent_entry[] __attribute__((visibility("hidden")));
+
+#endif /* __x86_64__ */
+
+/* A connection to pid's agent, or -1 if it has none */
+static int agent_connect(long pid) {
+    struct sockaddr_un addr;
+    struct ucred cred;
+    socklen_t credlen = sizeof(cred);
+    int addrlen;
+    int fd;
+
+    agent_sockaddr(pid, &addr, &addrlen);
+
+    /* the abstract name lives in the target's network namespace */
+    fd = ptmx_socket_in(pid, SOCK_STREAM);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, addrlen) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    /* anyone could have bound the name: only the target itself will do */
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) < 0
+        || cred.pid != pid) {
+        fprintf(stderr, "%s - agent socket of pid %ld is held by pid %d\n",
+                __FUNCTION__, pid, credlen == sizeof(cred) ? cred.pid : -1);
+        close(fd);
+        errno = EPERM;
+        return -1;
+    }
+
+    return fd;
+}
+
+static int agent_query(long pid, int op, int fd, struct agent_rep *rep) {
+    struct timeval tv = { 0, AGENT_CLIENT_USEC };
+    struct agent_req req;
+    size_t got = 0;
+    ssize_t n;
+    int s;
+
+    s = agent_connect(pid);
+    if (s < 0)
+        return -1;
+    /* nor are we held up by an agent busy with someone else: that is
+     * just a miss, and the caller has other ways to get its answer */
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    req.op = op;
+    req.fd = fd;
+    if (write(s, &req, sizeof(req)) != sizeof(req)) {
+        close(s);
+        return -1;
+    }
+
+    while (got < sizeof(*rep)) {
+        n = read(s, (char *)rep + got, sizeof(*rep) - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            close(s);
+            return -1;
+        }
+        got += n;
+    }
+    close(s);
+
+    if (rep->ret < 0) {
+        errno = -rep->ret;
+        return -1;
+    }
+
+    return 0;
+}
+
+int ptmx_agent_TIOCGPTN(long pid, int fd, int *pts) {
+    struct agent_rep rep;
+
+    if (agent_query(pid, AGENT_OP_TIOCGPTN, fd, &rep) < 0)
+        return -1;
+    *pts = rep.u.pts;
+
+    return 0;
+}
+
+int ptmx_agent_tcgets(long pid, int fd, struct termios *tos) {
+    struct agent_rep rep;
+
+    if (agent_query(pid, AGENT_OP_TCGETS, fd, &rep) < 0)
+        return -1;
+    *tos = rep.u.tos;
+
+    return 0;
+}
+
+int ptmx_agent_install(long pid) {
+#if defined __x86_64__
+    struct agent_params params;
+    struct agent_rep rep;
+    struct mytrace trace, *t = &trace;
+    long page = sysconf(_SC_PAGESIZE);
+    long code_len, len, base, tid;
+    long params_addr, stack_addr;
+    int i;
+
+    if (agent_query(pid, AGENT_OP_INFO, 0, &rep) == 0) {
+        debug("pid %ld already has an agent (tid %ld)", pid, rep.tid);
+        return 0;
+    }
+
+    code_len = (__stop_ptmx_agent - __start_ptmx_agent + page - 1) & ~(page - 1);
+    len = code_len + AGENT_PARAM_SIZE + page + AGENT_STACK_SIZE;
+
+    if (mytrace_attach(t, pid) < 0) {
+        fprintf(stderr, "%s - cannot access process %ld\n", __FUNCTION__, pid);
+        return -1;
+    }
+
+    base = mytrace_mmap(t, 0, len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == -1) {
+        perror("mytrace_mmap");
+        mytrace_detach(t);
+        return -1;
+    }
+    params_addr = base + code_len;
+    stack_addr = params_addr + AGENT_PARAM_SIZE + page;
+
+    memset(&params, 0, sizeof(params));
+    params.base = base;
+    params.len = len;
+    params.uid = getuid();
+    agent_sockaddr(pid, &params.addr, &params.addrlen);
+
+    if (mytrace_poke(t, base, __start_ptmx_agent,
+                     __stop_ptmx_agent - __start_ptmx_agent) < 0
+        || mytrace_poke(t, params_addr, &params, sizeof(params)) < 0
+        || mytrace_mprotect(t, base, code_len, PROT_READ | PROT_EXEC) < 0
+        || mytrace_mprotect(t, stack_addr - page, page, PROT_NONE) < 0) {
+        mytrace_munmap(t, base, len);
+        mytrace_detach(t);
+        return -1;
+    }
+
+    /* the hijacked thread runs the entry stub on the lower half of the
+     * stack, where a signal it takes cannot reach the agent's frames */
+    tid = mytrace_call(t, base + (ptmx_agent_entry - __start_ptmx_agent),
+                       params_addr, base + len,
+                       stack_addr + AGENT_STACK_SIZE / 2);
+    if (tid <= 0) {
+        fprintf(stderr, "%s - clone in pid %ld failed: %s\n", __FUNCTION__,
+                pid, strerror(tid < 0 ? -tid : EINVAL));
+        mytrace_munmap(t, base, len);
+        mytrace_detach(t);
+        return -1;
+    }
+
+    mytrace_detach(t);
+
+    debug("agent for pid %ld is tid %ld at 0x%lx", pid, tid, base);
+
+    /* give it a moment to bind */
+    for (i = 0; i < 100; i++) {
+        if (agent_query(pid, AGENT_OP_INFO, 0, &rep) == 0)
+            return 0;
+        usleep(10000);
+    }
+
+    fprintf(stderr, "%s - agent in pid %ld is not answering\n",
+            __FUNCTION__, pid);
+    return -1;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int ptmx_agent_remove(long pid) {
+    struct agent_rep info, rep;
+    struct mytrace trace, *t = &trace;
+    char path[64];
+    int i;
+
+    if (agent_query(pid, AGENT_OP_INFO, 0, &info) < 0) {
+        fprintf(stderr, "%s - pid %ld has no agent\n", __FUNCTION__, pid);
+        return -1;
+    }
+
+    agent_query(pid, AGENT_OP_QUIT, 0, &rep);
+
+    /* its code must not be unmapped under it: wait for the thread to go */
+    snprintf(path, sizeof(path), "/proc/%ld/task/%ld", pid, info.tid);
+    for (i = 0; i < 100 && access(path, F_OK) == 0; i++)
+        usleep(10000);
+    if (access(path, F_OK) == 0) {
+        fprintf(stderr, "%s - agent tid %ld did not exit\n", __FUNCTION__,
+                info.tid);
+        return -1;
+    }
+
+    if (mytrace_attach(t, pid) < 0) {
+        fprintf(stderr, "%s - cannot access process %ld\n", __FUNCTION__, pid);
+        return -1;
+    }
+    mytrace_munmap(t, info.base, info.len);
+    mytrace_detach(t);
+
+    return 0;
+}
@@ -0,0 +1,931 @@
+/*
+ * Copyright 2013
+ *  Steven Maresca <steve@zentific.com>
+ *  Zentific LLC
+ *
+ * app_probe:
+ *  Ask the program. QEMU, tmux and screen know which ptys they hold, and
+ *  asking them costs a socket round trip rather than a ptrace stop.
+ *
+ *  A probe is picked by the name of /proc/$PID/exe and says what it can:
+ *   qemu   QMP query-chardev, on the monitor named by -qmp or by
+ *          -chardev socket + -mon mode=control (path= or an inherited fd=)
+ *   tmux   list-panes through the server's own socket, run by the
+ *          system's tmux (root owned, never the target's binary) as the
+ *          socket's owner, or as the target's user (see below)
+ *   screen the controlling ttys of its window processes; its session
+ *          socket protocol is private and changes between releases
+ *  Sockets that are not plainly a monitor are never connected to: a
+ *  chardev socket would take the connection as its serial client.
+ *
+ *  Socket paths come from the target, so they are the target's word, not
+ *  ours. We connect as root only to a socket the target is itself
+ *  listening on: for a path, the node's inode must be one sock_diag
+ *  reports bound to a listening socket among the target's fds; for an
+ *  abstract name, one of those sockets must carry it. Anything else is
+ *  connected to by a child running as the target's own uid and gid, so a
+ *  process that names a socket it could not reach itself gets nowhere.
+ *
+ *  An answer is a set of ptys with no fds attached. The caller checks it
+ *  against the masters it actually sees and only uses what is certain.
+ *  The per-protocol entry points take a socket path so they can be
+ *  pointed at stand-in servers, and with pid 0 a tmux client binary too:
+ *  probe_standin does just that.
+ */
+
+#define _GNU_SOURCE             /* O_PATH, pipe2(), setresuid() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <grp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <linux/major.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/unix_diag.h>
+
+#include "ptmx_resolve.h"
+
+#define PROBE_TIMEOUT_MSEC 500
+#define PROBE_BUF_SIZE     16384  /* a QMP reply, tmux output, a cmdline */
+#define PROBE_MAX_CHARDEVS 32
+#define PROBE_MAX_SOCKETS  64
+
+struct app_probe {
+    char const *name;
+    char const *exe;            /* basename prefix of /proc/$PID/exe */
+    int (*run)(long pid, struct ptsname_probe_pty *ptys, int max_ptys);
+};
+
+static int probe_qemu(long pid, struct ptsname_probe_pty *ptys, int max_ptys);
+static int probe_tmux(long pid, struct ptsname_probe_pty *ptys, int max_ptys);
+static int probe_screen(long pid, struct ptsname_probe_pty *ptys,
+                        int max_ptys);
+
+static struct app_probe const probes[] = {
+    { "qemu",   "qemu",   probe_qemu },
+    { "tmux",   "tmux",   probe_tmux },
+    { "screen", "screen", probe_screen },
+    { "screen", "SCREEN", probe_screen },
+};
+
+/* "/dev/pts/N" anywhere in s, as N; -1 if none */
+static int pts_of(char const *s) {
+    char const *p = strstr(s, "/dev/pts/");
+
+    if (!p || p[9] < '0' || p[9] > '9')
+        return -1;
+
+    return atoi(p + 9);
+}
+
+static int pty_add(struct ptsname_probe_pty *ptys, int num, int max,
+                   int pts, char const *label, size_t label_len) {
+    if (pts < 0 || num >= max)
+        return num;
+    for (int i = 0; i < num; i++) {
+        if (ptys[i].pts == pts)
+            return num;
+    }
+    if (label_len >= sizeof(ptys[num].label))
+        label_len = sizeof(ptys[num].label) - 1;
+    ptys[num].pts = pts;
+    memcpy(ptys[num].label, label, label_len);
+    ptys[num].label[label_len] = '\0';
+
+    return num + 1;
+}
+
+/* an O_PATH fd on a socket node as pid sees it: under its root, or its
+ * cwd when relative */
+static int unix_node(long pid, char const *path) {
+    char full[PATH_MAX];
+
+    if (pid > 0)
+        snprintf(full, sizeof(full), "/proc/%ld/%s/%s", pid,
+                 path[0] == '/' ? "root" : "cwd", path);
+    else
+        snprintf(full, sizeof(full), "%s", path);
+
+    return open(full, O_PATH | O_CLOEXEC);
+}
+
+/* the inodes of pid's sockets: the one at fd, or with fd < 0 all of them */
+static int socket_inodes(long pid, int fd, unsigned long *inodes, int max) {
+    char fdpath[PATH_MAX], link[64];
+    struct proc_dir dir;
+    char const *name;
+    int num = 0;
+    ssize_t n;
+
+    snprintf(fdpath, sizeof(fdpath), "/proc/%ld/fd", pid);
+    if (proc_dir_open(&dir, fdpath) < 0)
+        return -1;
+    while ((name = proc_dir_next(&dir)) && num < max) {
+        if (fd >= 0 && atoi(name) != fd)
+            continue;
+        snprintf(fdpath, sizeof(fdpath), "/proc/%ld/fd/%s", pid, name);
+        n = readlink(fdpath, link, sizeof(link) - 1);
+        if (n <= 0)
+            continue;
+        link[n] = '\0';
+        if (!strncmp(link, "socket:[", 8))
+            inodes[num++] = strtoul(link + 8, NULL, 10);
+    }
+    proc_dir_close(&dir);
+
+    return num;
+}
+
+/*
+ * The path a listening unix socket of pid is bound to: the one at fd, or
+ * with fd < 0 the first one found, or with want the one bound to exactly
+ * that. Abstract names come back as "@name".
+ */
+static int unix_listener(long pid, int fd, char const *want, char *path,
+                         size_t size) {
+    char fdpath[64], buf[4096];
+    unsigned long inodes[PROBE_MAX_SOCKETS];
+    int num_inodes;
+    size_t have = 0;
+    ssize_t n;
+    int f;
+    int ret = -1;
+
+    num_inodes = socket_inodes(pid, fd, inodes, PROBE_MAX_SOCKETS);
+    if (num_inodes <= 0)
+        return -1;
+
+    snprintf(fdpath, sizeof(fdpath), "/proc/%ld/net/unix", pid);
+    f = open(fdpath, O_RDONLY | O_CLOEXEC);
+    if (f < 0)
+        return -1;
+
+    /* Num RefCount Protocol Flags Type St Inode Path, a line at a time */
+    while (ret < 0 && (n = read(f, buf + have, sizeof(buf) - 1 - have)) > 0) {
+        char *line = buf, *nl;
+
+        have += n;
+        buf[have] = '\0';
+        for (; ret < 0 && (nl = strchr(line, '\n')); line = nl + 1) {
+            unsigned int flags, st;
+            unsigned long ino;
+            int off = 0;
+
+            *nl = '\0';
+            if (sscanf(line, "%*s %*x %*x %x %*x %x %lu %n", &flags, &st,
+                       &ino, &off) != 3 || !off)
+                continue;
+            /* __SO_ACCEPTCON, SS_UNCONNECTED: listening */
+            if (!(flags & 0x10000) || st != 1 || !line[off])
+                continue;
+            if (want && strcmp(want, line + off))
+                continue;
+            for (int i = 0; i < num_inodes; i++) {
+                if (inodes[i] == ino) {
+                    snprintf(path, size, "%s", line + off);
+                    ret = 0;
+                    break;
+                }
+            }
+        }
+        /* keep the partial line; one longer than buf is dropped */
+        have = buf + have - line;
+        if (have == sizeof(buf) - 1)
+            have = 0;
+        memmove(buf, line, have);
+    }
+    close(f);
+
+    return ret;
+}
+
+/*
+ * Is node (an O_PATH fd) the very node a listening socket of pid is bound
+ * to? /proc only has socket inodes and the path given to bind(), which
+ * may lead elsewhere by now; sock_diag has the node's own device and
+ * inode. Asked in pid's network namespace, the only one it reports.
+ */
+static int unix_held(long pid, int node) {
+    struct {
+        struct nlmsghdr nlh;
+        struct unix_diag_req req;
+    } msg;
+    struct sockaddr_nl nl = { .nl_family = AF_NETLINK };
+    struct timeval tv = { 0, PROBE_TIMEOUT_MSEC * 1000 };
+    unsigned long inodes[PROBE_MAX_SOCKETS];
+    char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    int num_inodes, s, done = 0, held = 0;
+    struct stat st;
+    ssize_t n;
+
+    if (fstat(node, &st) < 0 || !S_ISSOCK(st.st_mode))
+        return 0;
+    num_inodes = socket_inodes(pid, -1, inodes, PROBE_MAX_SOCKETS);
+    if (num_inodes <= 0)
+        return 0;
+
+    s = ptmx_socket_in_ns(pid, AF_NETLINK, SOCK_RAW, NETLINK_SOCK_DIAG);
+    if (s < 0)
+        return 0;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    memset(&msg, 0, sizeof(msg));
+    msg.nlh.nlmsg_len = sizeof(msg);
+    msg.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    msg.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    msg.req.sdiag_family = AF_UNIX;
+    msg.req.udiag_states = 1 << 10;             /* TCP_LISTEN */
+    msg.req.udiag_show = UDIAG_SHOW_VFS;
+    if (sendto(s, &msg, sizeof(msg), 0, (struct sockaddr *)&nl,
+               sizeof(nl)) < 0) {
+        debug("probe: no sock_diag here: %s", strerror(errno));
+        close(s);
+        return 0;
+    }
+
+    while (!done && !held && (n = recv(s, buf, sizeof(buf), 0)) > 0) {
+        struct nlmsghdr *h = (struct nlmsghdr *)buf;
+
+        for (; !held && NLMSG_OK(h, n); h = NLMSG_NEXT(h, n)) {
+            struct unix_diag_msg *d = NLMSG_DATA(h);
+            struct nlattr *a;
+            int mine = 0, len;
+
+            if (h->nlmsg_type == NLMSG_DONE || h->nlmsg_type == NLMSG_ERROR) {
+                done = 1;
+                break;
+            }
+            for (int i = 0; i < num_inodes && !mine; i++)
+                mine = inodes[i] == d->udiag_ino;
+            if (!mine)
+                continue;
+
+            a = (struct nlattr *)((char *)d + NLA_ALIGN(sizeof(*d)));
+            len = h->nlmsg_len - NLMSG_LENGTH(NLA_ALIGN(sizeof(*d)));
+            while (len >= (int)sizeof(*a) && a->nla_len >= sizeof(*a)
+                   && a->nla_len <= len) {
+                if (a->nla_type == UNIX_DIAG_VFS) {
+                    struct unix_diag_vfs *v =
+                        (struct unix_diag_vfs *)((char *)a + NLA_HDRLEN);
+
+                    /* the kernel's own dev_t: 12 bits major, 20 minor */
+                    held = v->udiag_vfs_ino == st.st_ino
+                        && makedev(v->udiag_vfs_dev >> 20,
+                                   v->udiag_vfs_dev & 0xfffff) == st.st_dev;
+                }
+                len -= NLA_ALIGN(a->nla_len);
+                a = (struct nlattr *)((char *)a + NLA_ALIGN(a->nla_len));
+            }
+        }
+    }
+    close(s);
+
+    return held;
+}
+
+/* reap child, killing it once the probe's time is up; its exit status */
+static int reap_client(pid_t child) {
+    int status, waited = 0;
+    pid_t r;
+
+    while ((r = waitpid(child, &status, WNOHANG)) == 0
+           && waited < PROBE_TIMEOUT_MSEC) {
+        usleep(10000);
+        waited += 10;
+    }
+    if (r == 0) {
+        kill(child, SIGKILL);
+        waitpid(child, &status, 0);
+        return -1;
+    }
+    if (r < 0 || !WIFEXITED(status))
+        return -1;
+
+    return WEXITSTATUS(status);
+}
+
+/* who pid runs as (effective ids), to act on its word with its rights */
+static int proc_ids(long pid, uid_t *uid, gid_t *gid) {
+    char path[64], buf[2048];
+    char const *p, *end;
+    long long r;
+    ssize_t n;
+    int f;
+
+    snprintf(path, sizeof(path), "/proc/%ld/status", pid);
+    f = open(path, O_RDONLY | O_CLOEXEC);
+    if (f < 0)
+        return -1;
+    n = read(f, buf, sizeof(buf));
+    close(f);
+    if (n <= 0)
+        return -1;
+    end = buf + n;
+
+    /* "Uid:\treal\teffective\tsaved\tfs" */
+    p = proc_find(buf, n, "Uid:");
+    if (!p || proc_num(p, end, &p) < 0 || !p || (r = proc_num(p, end, NULL)) < 0)
+        return -1;
+    *uid = r;
+    p = proc_find(buf, n, "Gid:");
+    if (!p || proc_num(p, end, &p) < 0 || !p || (r = proc_num(p, end, NULL)) < 0)
+        return -1;
+    *gid = r;
+
+    return 0;
+}
+
+/* for a child about to act for someone else: become them, all of them;
+ * without root, only ourselves will do */
+static int drop_to(uid_t uid, gid_t gid) {
+    if (geteuid() != 0)
+        return geteuid() == uid ? 0 : -1;
+
+    return setgroups(0, NULL) < 0 || setresgid(gid, gid, gid) < 0
+        || setresuid(uid, uid, uid) < 0 ? -1 : 0;
+}
+
+/*
+ * Connect s from a child running as pid's own user: the socket is shared,
+ * so the connection is ours to use once the child is done, and the
+ * server saw (and checked) the target's credentials, not root's.
+ */
+static int connect_as(long pid, int s, struct sockaddr_un const *addr,
+                      socklen_t len) {
+    uid_t uid;
+    gid_t gid;
+    pid_t child;
+
+    if (proc_ids(pid, &uid, &gid) < 0)
+        return -1;
+
+    child = fork();
+    if (child < 0)
+        return -1;
+    if (child == 0) {
+        if (drop_to(uid, gid) < 0
+            || connect(s, (struct sockaddr const *)addr, len) < 0)
+            _exit(1);
+        _exit(0);
+    }
+    if (reap_client(child) != 0) {
+        errno = EACCES;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * A stream socket connected to path as pid sees it: abstract names
+ * ("@...") in its network namespace, others through unix_node(), so the
+ * path's length does not matter. Sockets pid is not itself listening on
+ * are connected to with pid's rights, not ours.
+ */
+static int unix_connect(long pid, char const *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct timeval tv = { 0, PROBE_TIMEOUT_MSEC * 1000 };
+    char name[sizeof(addr.sun_path) + 1];
+    socklen_t len;
+    int s, node = -1, held;
+
+    s = pid > 0 && path[0] == '@' ? ptmx_socket_in(pid, SOCK_STREAM)
+        : socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s < 0)
+        return -1;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if (path[0] == '@') {
+        len = strnlen(path, sizeof(addr.sun_path));
+        memcpy(addr.sun_path + 1, path + 1, len - 1);
+        /* names are unique per namespace: one of pid's own will do */
+        snprintf(name, sizeof(name), "%.*s", (int)len, path);
+        held = pid <= 0 || unix_listener(pid, -1, name, NULL, 0) == 0;
+        len += offsetof(struct sockaddr_un, sun_path);
+    } else {
+        node = unix_node(pid, path);
+        if (node < 0)
+            goto fail;
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "/proc/self/fd/%d",
+                 node);
+        len = sizeof(addr);
+        held = pid <= 0 || unix_held(pid, node);
+    }
+
+    if (!held)
+        debug("probe: %s is not a socket %ld listens on, connecting as it",
+              path, pid);
+    if ((held ? connect(s, (struct sockaddr *)&addr, len)
+              : connect_as(pid, s, &addr, len)) < 0)
+        goto fail;
+    if (node >= 0)
+        close(node);
+
+    return s;
+
+fail:
+    debug("probe: cannot connect to %s: %s", path, strerror(errno));
+    if (node >= 0)
+        close(node);
+    close(s);
+
+    return -1;
+}
+
+/* one QMP message that is not an event, newline terminated, into buf */
+static int qmp_read(int s, char *buf, size_t size, size_t *have) {
+    for (;;) {
+        char *nl = memchr(buf, '\n', *have);
+        ssize_t n;
+
+        if (nl) {
+            size_t line = nl - buf + 1;
+
+            *nl = '\0';
+            if (!strstr(buf, "\"event\""))
+                return line;
+            memmove(buf, nl + 1, *have - line);
+            *have -= line;
+            continue;
+        }
+        if (*have + 1 >= size)
+            return -1;
+        n = recv(s, buf + *have, size - *have - 1, 0);
+        if (n <= 0)
+            return -1;
+        *have += n;
+    }
+}
+
+static int qmp_execute(int s, char const *cmd, char *buf, size_t size,
+                       size_t *have) {
+    int line;
+
+    /* whatever was read past the previous reply is kept */
+    if (send(s, cmd, strlen(cmd), MSG_NOSIGNAL) < 0)
+        return -1;
+    line = qmp_read(s, buf, size, have);
+    if (line < 0 || !strstr(buf, "\"return\""))
+        return -1;
+
+    return line;
+}
+
+/* the string value of "key" in the flat JSON object [p, end) */
+static int json_str(char const *p, char const *end, char const *key,
+                    char const **val, size_t *val_len) {
+    size_t klen = strlen(key);
+
+    for (; p + klen + 2 < end; p++) {
+        char const *q;
+
+        if (*p != '"' || strncmp(p + 1, key, klen) || p[klen + 1] != '"')
+            continue;
+        q = p + klen + 2;
+        while (q < end && (*q == ' ' || *q == ':'))
+            q++;
+        if (q >= end || *q != '"')
+            return -1;
+        *val = ++q;
+        while (q < end && *q != '"')
+            q++;
+        *val_len = q - *val;
+        return 0;
+    }
+
+    return -1;
+}
+
+int ptsname_probe_qmp(long pid, char const *sock_path,
+                      struct ptsname_probe_pty *ptys, int max_ptys) {
+    char buf[PROBE_BUF_SIZE], *p, *end;
+    size_t have = 0;
+    int num = 0;
+    int line;
+    int s;
+
+    s = unix_connect(pid, sock_path);
+    if (s < 0)
+        return -1;
+
+    /* {"QMP": {"version": ...}} first, then capabilities negotiation */
+    line = qmp_read(s, buf, PROBE_BUF_SIZE, &have);
+    if (line < 0 || !strstr(buf, "\"QMP\"")) {
+        num = -1;
+        goto wrap_up;
+    }
+    memmove(buf, buf + line, have - line);
+    have -= line;
+
+    line = qmp_execute(s, "{\"execute\": \"qmp_capabilities\"}\n", buf,
+                       PROBE_BUF_SIZE, &have);
+    if (line < 0) {
+        num = -1;
+        goto wrap_up;
+    }
+    memmove(buf, buf + line, have - line);
+    have -= line;
+
+    /* {"return": [{"frontend-open": true, "filename": "pty:/dev/pts/3",
+     *              "label": "serial0"}, ...]} */
+    line = qmp_execute(s, "{\"execute\": \"query-chardev\"}\n", buf,
+                       PROBE_BUF_SIZE, &have);
+    if (line < 0) {
+        num = -1;
+        goto wrap_up;
+    }
+
+    end = buf + line;
+    for (p = strchr(buf, '['); p && (p = memchr(p, '{', end - p)); p++) {
+        char const *obj_end = memchr(p, '}', end - p);
+        char const *file, *label;
+        size_t file_len, label_len;
+
+        if (!obj_end)
+            break;
+        if (json_str(p, obj_end, "filename", &file, &file_len) == 0
+            && file_len > 4 && !strncmp(file, "pty:", 4)
+            && json_str(p, obj_end, "label", &label, &label_len) == 0) {
+            char name[PATH_MAX];
+
+            snprintf(name, sizeof(name), "%.*s", (int)file_len, file);
+            num = pty_add(ptys, num, max_ptys, pts_of(name), label,
+                          label_len);
+        }
+        p = (char *)obj_end;
+    }
+
+wrap_up:
+    close(s);
+
+    return num;
+}
+
+/* value of "key=" in a QEMU option string, and its length */
+static char const *qemu_opt(char const *opts, char const *key, int *len) {
+    size_t klen = strlen(key);
+    char const *p = opts;
+
+    while (p && *p) {
+        if (!strncmp(p, key, klen) && p[klen] == '=') {
+            p += klen + 1;
+            *len = strcspn(p, ",");
+            return p;
+        }
+        p = strchr(p, ',');
+        if (p)
+            p++;
+    }
+
+    return NULL;
+}
+
+/*
+ * The QMP monitor socket of a QEMU, from its command line:
+ *   -qmp unix:PATH[,server...]
+ *   -chardev socket,id=ID,path=PATH|fd=N,... -mon chardev=ID,mode=control
+ * Chardevs are remembered as spans of the command line buffer.
+ */
+static int qemu_monitor(long pid, char *path, size_t size) {
+    struct {
+        char const *id, *path;
+        int id_len, path_len;
+        int fd;
+    } chardevs[PROBE_MAX_CHARDEVS];
+    char cmdline[PROBE_BUF_SIZE * 2];
+    char const *mon = NULL;
+    int mon_len = 0;
+    int num_chardevs = 0;
+    char *arg, *end;
+    ssize_t n;
+    int f;
+
+    snprintf(cmdline, sizeof(cmdline), "/proc/%ld/cmdline", pid);
+    f = open(cmdline, O_RDONLY | O_CLOEXEC);
+    if (f < 0)
+        return -1;
+    n = read(f, cmdline, sizeof(cmdline) - 1);
+    close(f);
+    if (n <= 0)
+        return -1;
+    cmdline[n] = '\0';
+    end = cmdline + n;
+
+    for (arg = cmdline; arg < end; arg += strlen(arg) + 1) {
+        char *opt = arg + strlen(arg) + 1;
+        char *a = arg[0] == '-' && arg[1] == '-' ? arg + 1 : arg;
+        char const *val;
+        int len;
+
+        if (opt >= end)
+            break;
+
+        if ((!strcmp(a, "-qmp") || !strcmp(a, "-qmp-pretty"))
+            && !strncmp(opt, "unix:", 5)) {
+            snprintf(path, size, "%.*s", (int)strcspn(opt + 5, ","), opt + 5);
+            return 0;
+        }
+
+        if (!strcmp(a, "-chardev") && !strncmp(opt, "socket,", 7)
+            && num_chardevs < PROBE_MAX_CHARDEVS
+            && (val = qemu_opt(opt, "id", &len))) {
+            chardevs[num_chardevs].id = val;
+            chardevs[num_chardevs].id_len = len;
+            chardevs[num_chardevs].fd = -1;
+            chardevs[num_chardevs].path = qemu_opt(opt, "path",
+                                                   &chardevs[num_chardevs].path_len);
+            if ((val = qemu_opt(opt, "fd", &len)))
+                chardevs[num_chardevs].fd = atoi(val);
+            num_chardevs++;
+        }
+
+        if (!strcmp(a, "-mon") && (val = qemu_opt(opt, "mode", &len))
+            && len == 7 && !strncmp(val, "control", 7))
+            mon = qemu_opt(opt, "chardev", &mon_len);
+    }
+
+    for (int i = 0; mon && i < num_chardevs; i++) {
+        if (chardevs[i].id_len != mon_len
+            || strncmp(chardevs[i].id, mon, mon_len))
+            continue;
+        if (chardevs[i].path && chardevs[i].path_len) {
+            snprintf(path, size, "%.*s", chardevs[i].path_len,
+                     chardevs[i].path);
+            return 0;
+        }
+        /* handed over already listening, as libvirt does */
+        if (chardevs[i].fd >= 0)
+            return unix_listener(pid, chardevs[i].fd, NULL, path, size);
+    }
+
+    return -1;
+}
+
+static int probe_qemu(long pid, struct ptsname_probe_pty *ptys, int max_ptys) {
+    char path[PATH_MAX];
+
+    if (qemu_monitor(pid, path, sizeof(path)) < 0)
+        return -1;
+
+    debug("probe: qemu %ld monitor at %s", pid, path);
+
+    return ptsname_probe_qmp(pid, path, ptys, max_ptys);
+}
+
+/*
+ * A tmux we can vouch for: the system's, a root owned file in a root owned
+ * directory, neither writable by anyone else. Never the server's own
+ * binary, which is whatever its (possibly unprivileged) owner put there.
+ */
+static char const *trusted_tmux(char real[PATH_MAX]) {
+    static char const *const paths[] = { "/usr/bin/tmux", "/bin/tmux",
+                                         "/usr/local/bin/tmux" };
+    struct stat st;
+
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        char *slash;
+
+        if (!realpath(paths[i], real) || stat(real, &st) < 0
+            || !S_ISREG(st.st_mode) || st.st_uid != 0
+            || (st.st_mode & (S_IWGRP | S_IWOTH)) || !(st.st_mode & S_IXUSR))
+            continue;
+        slash = strrchr(real, '/');
+        *slash = '\0';
+        if (stat(real[0] ? real : "/", &st) < 0 || st.st_uid != 0
+            || (st.st_mode & (S_IWGRP | S_IWOTH)))
+            continue;
+        *slash = '/';
+        return real;
+    }
+
+    return NULL;
+}
+
+int ptsname_probe_tmux(long pid, char const *sock_path, char const *client,
+                       struct ptsname_probe_pty *ptys, int max_ptys) {
+    char const *argv[] = { "tmux", "-S", "/proc/self/fd/3", "list-panes",
+                           "-a", "-F", "#{pane_tty} #{session_name}:"
+                           "#{window_index}.#{pane_index}", NULL };
+    char const *envp[] = { "PATH=/usr/bin:/bin", NULL };
+    char buf[PROBE_BUF_SIZE], real[PATH_MAX];
+    char const *tmux;
+    struct pollfd pfd;
+    struct stat st;
+    size_t have = 0;
+    int pipefd[2];
+    int node, num = 0;
+    int eof = 0;
+    pid_t child;
+
+    /* a client of the caller's choosing is for stand-ins, never for a
+     * live target */
+    if (client && pid > 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    tmux = client ? client : trusted_tmux(real);
+    if (!tmux) {
+        debug("probe: no root owned tmux to ask with");
+        return -1;
+    }
+
+    /* found as root, then handed over: the client resolves nothing */
+    if (sock_path[0] == '@')
+        return -1;
+    node = unix_node(pid, sock_path);
+    if (node < 0)
+        return -1;
+    if (fstat(node, &st) < 0 || !S_ISSOCK(st.st_mode)
+        || pipe2(pipefd, O_CLOEXEC) < 0) {
+        close(node);
+        return -1;
+    }
+    /* the server's owner if it is the server's socket, else the target's
+     * own user: the path is only its word */
+    if (pid > 0 && !unix_held(pid, node)) {
+        debug("probe: %s is not a socket %ld listens on, asking as it",
+              sock_path, pid);
+        if (proc_ids(pid, &st.st_uid, &st.st_gid) < 0) {
+            close(node);
+            close(pipefd[0]);
+            close(pipefd[1]);
+            return -1;
+        }
+    }
+
+    child = fork();
+    if (child < 0) {
+        close(node);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+    if (child == 0) {
+        int null = open("/dev/null", O_RDWR);
+
+        dup2(null, STDIN_FILENO);
+        dup2(pipefd[1], STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        if (node == 3)
+            fcntl(node, F_SETFD, 0);
+        else
+            dup2(node, 3);
+
+        /* the client runs as whoever owns the server, never as us */
+        if (drop_to(st.st_uid, st.st_gid) < 0)
+            _exit(127);
+        execve(tmux, (char **)argv, (char **)envp);
+        _exit(127);
+    }
+    close(node);
+    close(pipefd[1]);
+
+    pfd.fd = pipefd[0];
+    pfd.events = POLLIN;
+    while (have < sizeof(buf) - 1
+           && poll(&pfd, 1, PROBE_TIMEOUT_MSEC) > 0) {
+        ssize_t n = read(pipefd[0], buf + have, sizeof(buf) - 1 - have);
+
+        if (n <= 0) {
+            eof = n == 0;
+            break;
+        }
+        have += n;
+    }
+    buf[have] = '\0';
+    close(pipefd[0]);
+
+    /* output cut short by the timeout or the buffer is no answer */
+    if (!eof)
+        kill(child, SIGKILL);
+    if (reap_client(child) != 0 || !eof)
+        return -1;
+
+    /* "/dev/pts/3 main:0.1" per pane */
+    for (char *line = buf, *nl; *line; line = nl + 1) {
+        char *label;
+
+        nl = strchr(line, '\n');
+        if (!nl)
+            break;
+        *nl = '\0';
+        label = strchr(line, ' ');
+        num = pty_add(ptys, num, max_ptys, pts_of(line),
+                      label ? label + 1 : "", label ? strlen(label + 1) : 0);
+    }
+
+    return num;
+}
+
+static int probe_tmux(long pid, struct ptsname_probe_pty *ptys, int max_ptys) {
+    char sock[PATH_MAX];
+
+    /* a client has no listening socket, only the server does */
+    if (unix_listener(pid, -1, NULL, sock, sizeof(sock)) < 0)
+        return -1;
+
+    debug("probe: tmux %ld server at %s", pid, sock);
+
+    return ptsname_probe_tmux(pid, sock, NULL, ptys, max_ptys);
+}
+
+/* the slave a window process got as its controlling tty, from its stat */
+static int ctty_pts(long pid) {
+    char path[64], buf[1024];
+    int const field = 7;
+    long long tty_nr;
+    ssize_t n;
+    int f;
+
+    snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+    f = open(path, O_RDONLY | O_CLOEXEC);
+    if (f < 0)
+        return -1;
+    n = read(f, buf, sizeof(buf));
+    close(f);
+    if (n <= 0 || proc_stat_fields(buf, n, &field, 1, &tty_nr) < 0
+        || tty_nr <= 0)
+        return -1;
+
+    if (major(tty_nr) < UNIX98_PTY_SLAVE_MAJOR
+        || major(tty_nr) >= UNIX98_PTY_SLAVE_MAJOR + UNIX98_PTY_MAJOR_COUNT)
+        return -1;
+
+    return (major(tty_nr) - UNIX98_PTY_SLAVE_MAJOR) * 256 + minor(tty_nr);
+}
+
+static int probe_screen(long pid, struct ptsname_probe_pty *ptys,
+                        int max_ptys) {
+    char path[64], kids[PROBE_BUF_SIZE];
+    ssize_t n;
+    int num = 0;
+    int f;
+
+    /* the server forks every window from its main thread */
+    snprintf(path, sizeof(path), "/proc/%ld/task/%ld/children", pid, pid);
+    f = open(path, O_RDONLY | O_CLOEXEC);
+    if (f < 0)
+        return -1;
+    n = read(f, kids, sizeof(kids) - 1);
+    close(f);
+    if (n <= 0)
+        return 0;
+    kids[n] = '\0';
+
+    for (char *p = kids, *next; *p; p = next) {
+        long child = strtol(p, &next, 10);
+        char label[32];
+
+        if (next == p)
+            break;
+        snprintf(label, sizeof(label), "pid %ld", child);
+        num = pty_add(ptys, num, max_ptys, ctty_pts(child), label,
+                      strlen(label));
+    }
+
+    return num;
+}
+
+int ptsname_probe(long pid, struct ptsname_probe_pty *ptys, int max_ptys,
+                  char const **probe_name) {
+    char path[64], exe[PATH_MAX];
+    char const *base;
+    ssize_t n;
+
+    snprintf(path, sizeof(path), "/proc/%ld/exe", pid);
+    n = readlink(path, exe, sizeof(exe) - 1);
+    if (n <= 0)
+        return -1;
+    exe[n] = '\0';
+    base = strrchr(exe, '/');
+    base = base ? base + 1 : exe;
+
+    for (size_t i = 0; i < sizeof(probes) / sizeof(probes[0]); i++) {
+        int num;
+
+        if (strncmp(base, probes[i].exe, strlen(probes[i].exe)))
+            continue;
+        num = probes[i].run(pid, ptys, max_ptys);
+        debug("probe: %s %ld -> %d ptys", probes[i].name, pid, num);
+        if (num >= 0 && probe_name)
+            *probe_name = probes[i].name;
+        return num;
+    }
+
+    return -1;
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright 2013
+ *  Steven Maresca <steve@zentific.com>
+ *  Zentific LLC
+ *
+ * bench_proc_parse:
+ *  The proc_parse scanners against their own scalar fallbacks, on the
+ *  same in-memory buffers: this process's stat and status, and the fdinfo
+ *  of a master it opens. The file is included whole, so the static SSE2,
+ *  AVX2 and scalar versions are timed directly, next to what proc_find()
+ *  and proc_skip() pick for each buffer. Reports ns per call.
+ *
+ *  ./bench_proc_parse [iterations]
+ */
+
+#define _GNU_SOURCE             /* posix_openpt() */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "proc_parse.c"
+
+static volatile long long sink;
+
+/* what is being scanned, and for what */
+static char const *buf_p, *buf_end, *key;
+static size_t buf_len, key_len;
+static int skip_n;
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static ssize_t slurp(char const *path, char *buf, size_t size) {
+    ssize_t n;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    n = read(fd, buf, size - 1);
+    close(fd);
+    if (n <= 0) {
+        perror(path);
+        return -1;
+    }
+    buf[n] = '\0';
+
+    return n;
+}
+
+static void find_s(void) {
+    sink += (long long)(uintptr_t)find_scalar(buf_p, buf_len, key, key_len);
+}
+
+static void find_d(void) {
+    sink += (long long)(uintptr_t)proc_find(buf_p, buf_len, key);
+}
+
+static void skip_s(void) {
+    sink += (long long)(uintptr_t)skip_scalar(buf_p, buf_end, skip_n);
+}
+
+static void skip_d(void) {
+    sink += (long long)(uintptr_t)proc_skip(buf_p, buf_end, skip_n);
+}
+
+#if defined __SSE2__
+
+static void find_v(void) {
+    sink += (long long)(uintptr_t)find_sse2(buf_p, buf_len, key, key_len);
+}
+
+static void find_w(void) {
+    sink += (long long)(uintptr_t)find_avx2(buf_p, buf_len, key, key_len);
+}
+
+static void skip_v(void) {
+    sink += (long long)(uintptr_t)skip_sse2(buf_p, buf_end, skip_n);
+}
+
+static void skip_w(void) {
+    sink += (long long)(uintptr_t)skip_avx2(buf_p, buf_end, skip_n);
+}
+
+#endif /* __SSE2__ */
+
+/* the best of a few runs: anything slower was the machine, not the code */
+static double bench(void (*fn)(void), long iters) {
+    double t, best = 0;
+
+    for (long i = 0; i < iters / 10; i++)
+        fn();
+    for (int run = 0; run < 5; run++) {
+        t = now_ns();
+        for (long i = 0; i < iters; i++)
+            fn();
+        t = (now_ns() - t) / iters;
+        if (run == 0 || t < best)
+            best = t;
+    }
+
+    return best;
+}
+
+/* one line: scalar, SSE2, AVX2 (where the CPU has it), then the dispatch */
+static void report(char const *what, size_t len, void (*scalar)(void),
+                   void (*sse2)(void), void (*avx2)(void),
+                   void (*dispatch)(void), long iters) {
+    printf("  %-18s %5zu  %7.1f", what, len, bench(scalar, iters));
+#if defined __SSE2__
+    printf("  %7.1f", bench(sse2, iters));
+    if (have_avx2())
+        printf("  %7.1f", bench(avx2, iters));
+    else
+        printf("  %7s", "-");
+#else
+    (void)sse2;
+    (void)avx2;
+    printf("  %7s  %7s", "-", "-");
+#endif
+    printf("  %7.1f\n", bench(dispatch, iters));
+}
+
+static void report_find(char const *what, char const *buf, size_t len,
+                        char const *k, long iters) {
+    buf_p = buf;
+    buf_len = len;
+    key = k;
+    key_len = strlen(k);
+#if defined __SSE2__
+    report(what, len, find_s, find_v, find_w, find_d, iters);
+#else
+    report(what, len, find_s, NULL, NULL, find_d, iters);
+#endif
+}
+
+int main(int argc, char **argv) {
+    char stat_buf[1024], status_buf[4096], fdinfo_buf[512], path[64];
+    ssize_t stat_len, status_len, fdinfo_len;
+    long iters = argc > 1 ? atol(argv[1]) : 1000000;
+    char const *fields;
+    int master;
+
+    if (iters <= 0) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0) {
+        perror("posix_openpt");
+        return 1;
+    }
+    snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", master);
+
+    stat_len = slurp("/proc/self/stat", stat_buf, sizeof(stat_buf));
+    status_len = slurp("/proc/self/status", status_buf, sizeof(status_buf));
+    fdinfo_len = slurp(path, fdinfo_buf, sizeof(fdinfo_buf));
+    close(master);
+    if (stat_len < 0 || status_len < 0 || fdinfo_len < 0)
+        return 1;
+    if (!strstr(fdinfo_buf, "tty-index:"))
+        printf("(no tty-index in fdinfo on this kernel: all miss)\n");
+
+    printf("%ld iterations, ns per call\n", iters);
+    printf("  %-18s %5s  %7s  %7s  %7s  %7s\n", "", "bytes", "scalar",
+           "sse2", "avx2", "used");
+    report_find("fdinfo tty-index", fdinfo_buf, fdinfo_len, "tty-index:",
+                iters);
+    report_find("status Tgid", status_buf, status_len, "Tgid:", iters);
+    report_find("status (miss)", status_buf, status_len, "Nope:", iters);
+
+    /* from field 3 on to field 41, as ptsname_class() does */
+    fields = memrchr(stat_buf, ')', stat_len);
+    if (!fields)
+        return 1;
+    buf_p = fields + 2;
+    buf_end = stat_buf + stat_len;
+    skip_n = 41 - 3;
+#if defined __SSE2__
+    report("stat skip to 41", buf_end - buf_p, skip_s, skip_v, skip_w, skip_d,
+           iters);
+#else
+    report("stat skip to 41", buf_end - buf_p, skip_s, NULL, NULL, skip_d,
+           iters);
+#endif
+
+    return 0;
+}
@@ -1,4 +1,15 @@
 #!/bin/bash
 
-gcc -o ptmx_resolve ptmx_resolve.c ptsname_proxy.c  mytrace.c 
-#gcc -o ptmx_resolve ptmx_resolve.c ptsname_proxy.c  mytrace.c -DDEBUG=1
+gcc -o ptmx_resolve ptmx_resolve.c ptsname_proxy.c  mytrace.c pty_relay.c console_server.c pts_namespace.c agent.c fd_extract.c pts_fuse.c stop_budget.c pts_timeline.c proc_uring.c proc_parse.c pts_cache.c app_probe.c -pthread
+#gcc -o ptmx_resolve ptmx_resolve.c ptsname_proxy.c  mytrace.c pty_relay.c console_server.c pts_namespace.c agent.c fd_extract.c pts_fuse.c stop_budget.c pts_timeline.c proc_uring.c proc_parse.c pts_cache.c app_probe.c -pthread -DDEBUG=1
+
+# the resolver alone, for embedding: no CLI, relay, console, fuse or timeline
+CORE="ptsname_proxy.c mytrace.c pts_namespace.c agent.c fd_extract.c stop_budget.c proc_uring.c proc_parse.c pts_cache.c app_probe.c"
+gcc -shared -fPIC -o libptmx_resolve.so $CORE -pthread
+gcc -c -fPIC $CORE && ar rcs libptmx_resolve.a ${CORE//.c/.o} && rm -f ${CORE//.c/.o}
+
+# the /proc scanners against their own scalar versions
+gcc -O2 -o bench_proc_parse bench_proc_parse.c
+
+# the app probes against a stand-in QMP server and a fake tmux client
+gcc -o probe_standin probe_standin.c $CORE -pthread
@@ -0,0 +1,415 @@
+/*
+ * Copyright 2013
+ *  Steven Maresca <steve@zentific.com>
+ *  Zentific LLC
+ *
+ * console_server:
+ *  Open each resolved /dev/pts slave exactly once and fan its output out
+ *  to any number of unix socket clients ($DIR/pts-$PTS.sock).
+ *
+ *  Output of a pty is read straight into a single ring buffer, mapped
+ *  twice back to back so that any window of it is contiguous. Clients
+ *  only own a read cursor into that ring and are written to directly
+ *  from it, so nothing is copied per client in user space. A client that
+ *  falls further behind than the ring (the bounded scrollback) skips
+ *  ahead instead of stalling the pty or the other clients. Input from
+ *  any client is forwarded to the pty.
+ */
+
+#define _GNU_SOURCE             /* memfd_create(), accept4() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include "ptmx_resolve.h"
+
+#define SERVE_READ_MAX 65536    /* largest single read from a pty */
+
+struct serve_client {
+    int fd;
+    uint64_t cursor;            /* absolute ring offset of next byte */
+};
+
+struct serve_pty {
+    char path[PATH_MAX];
+    char sock_path[PATH_MAX];
+    int fd;                     /* slave, -1 once the master went away */
+    int listen_fd;
+    struct termios saved;
+    int have_termios;
+
+    char *ring;                 /* size bytes, mapped twice */
+    size_t size;                /* power of two, multiple of page size */
+    uint64_t head;              /* absolute offset of next byte written */
+
+    struct serve_client *clients;
+    int num_clients, max_clients;
+};
+
+static volatile sig_atomic_t serve_stop = 0;
+
+static void serve_sighandler(int sig) {
+    (void)sig;
+    serve_stop = 1;
+}
+
+static size_t ring_size_for(size_t scrollback) {
+    size_t size = sysconf(_SC_PAGESIZE);
+
+    while (size < scrollback || size < SERVE_READ_MAX)
+        size <<= 1;
+
+    return size;
+}
+
+/* map a memfd twice, contiguously, so ring + (head & mask) always has
+ * `size` readable/writable bytes following it */
+static char *ring_create(size_t size) {
+    char *base;
+    int fd;
+
+    fd = memfd_create("ptmx_resolve-ring", MFD_CLOEXEC);
+    if (fd < 0) {
+        perror("memfd_create");
+        return NULL;
+    }
+    if (ftruncate(fd, size) < 0) {
+        perror("ftruncate");
+        close(fd);
+        return NULL;
+    }
+
+    base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap (ring reserve)");
+        close(fd);
+        return NULL;
+    }
+
+    if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             fd, 0) == MAP_FAILED
+        || mmap(base + size, size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        perror("mmap (ring mirror)");
+        munmap(base, 2 * size);
+        close(fd);
+        return NULL;
+    }
+
+    /* the mappings keep the memory alive */
+    close(fd);
+
+    return base;
+}
+
+static int serve_listen(char const *sock_path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s - socket path too long: %s\n", __FUNCTION__,
+                sock_path);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sock_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    unlink(sock_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(fd, 16) < 0) {
+        perror(sock_path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int serve_pty_open(struct serve_pty *p, char const *pts_path,
+                          char const *dir, size_t scrollback) {
+    char tmp[PATH_MAX];
+    struct termios raw;
+
+    memset(p, 0, sizeof(*p));
+    p->fd = p->listen_fd = -1;
+
+    snprintf(p->path, sizeof(p->path), "%s", pts_path);
+    snprintf(tmp, sizeof(tmp), "%s", pts_path);
+    snprintf(p->sock_path, sizeof(p->sock_path), "%s/pts-%s.sock",
+             dir, basename(tmp));
+
+    p->size = ring_size_for(scrollback);
+    p->ring = ring_create(p->size);
+    if (!p->ring)
+        return -1;
+
+    p->fd = open(pts_path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (p->fd < 0) {
+        perror(pts_path);
+        return -1;
+    }
+
+    if (tcgetattr(p->fd, &p->saved) == 0) {
+        raw = p->saved;
+        cfmakeraw(&raw);
+        if (tcsetattr(p->fd, TCSANOW, &raw) == 0)
+            p->have_termios = 1;
+    }
+
+    p->listen_fd = serve_listen(p->sock_path);
+    if (p->listen_fd < 0)
+        return -1;
+
+    debug("serving %s on %s (ring %zu bytes)", p->path, p->sock_path, p->size);
+
+    return 0;
+}
+
+static void serve_client_drop(struct serve_pty *p, int i) {
+    close(p->clients[i].fd);
+    p->clients[i] = p->clients[--p->num_clients];
+}
+
+static void serve_pty_close(struct serve_pty *p) {
+    while (p->num_clients)
+        serve_client_drop(p, 0);
+    free(p->clients);
+
+    if (p->listen_fd >= 0) {
+        close(p->listen_fd);
+        unlink(p->sock_path);
+    }
+    if (p->fd >= 0) {
+        if (p->have_termios)
+            tcsetattr(p->fd, TCSANOW, &p->saved);
+        close(p->fd);
+    }
+    if (p->ring)
+        munmap(p->ring, 2 * p->size);
+}
+
+static void serve_accept(struct serve_pty *p) {
+    struct serve_client *c;
+    int fd;
+
+    while ((fd = accept4(p->listen_fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        if (p->num_clients == p->max_clients) {
+            int max = p->max_clients ? 2 * p->max_clients : 8;
+            c = realloc(p->clients, max * sizeof(*c));
+            if (!c) {
+                close(fd);
+                return;
+            }
+            p->clients = c;
+            p->max_clients = max;
+        }
+
+        /* new clients start with whatever scrollback the ring still has */
+        c = &p->clients[p->num_clients++];
+        c->fd = fd;
+        c->cursor = p->head > p->size ? p->head - p->size : 0;
+    }
+}
+
+/* pty -> ring; never blocks on clients */
+static int serve_fill(struct serve_pty *p) {
+    ssize_t n;
+
+    n = read(p->fd, p->ring + (p->head & (p->size - 1)), SERVE_READ_MAX);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    if (n <= 0) {
+        /* EIO: the master side was closed */
+        debug("%s: pty gone", p->path);
+        return -1;
+    }
+    p->head += n;
+
+    return 0;
+}
+
+/* ring -> client, straight out of the shared mapping */
+static int serve_drain(struct serve_pty *p, struct serve_client *c) {
+    ssize_t n;
+
+    if (p->head - c->cursor > p->size) {
+        debug("%s: client %d lagged, skipping %llu bytes", p->path, c->fd,
+              (unsigned long long)(p->head - p->size - c->cursor));
+        c->cursor = p->head - p->size;
+    }
+
+    while (c->cursor < p->head) {
+        n = send(c->fd, p->ring + (c->cursor & (p->size - 1)),
+                 p->head - c->cursor, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return 0;
+        if (n < 0)
+            return -1;
+        c->cursor += n;
+    }
+
+    return 0;
+}
+
+/* client -> pty */
+static int serve_input(struct serve_pty *p, struct serve_client *c) {
+    char buf[4096];
+    ssize_t n;
+
+    n = read(c->fd, buf, sizeof(buf));
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    if (n <= 0)
+        return -1;
+
+    if (p->fd >= 0 && write(p->fd, buf, n) < 0 && errno != EAGAIN)
+        debug("%s: write failed: %s", p->path, strerror(errno));
+
+    return 0;
+}
+
+int ptmx_serve(char const *const *pts_paths, int num_paths,
+               char const *dir, size_t scrollback) {
+    struct serve_pty *ptys;
+    struct pollfd *pfd = NULL;
+    struct sigaction sa;
+    int max_pfd = 0;
+    int ret = -1;
+    int i, j;
+
+    if (num_paths <= 0) {
+        fprintf(stderr, "%s - nothing to serve\n", __FUNCTION__);
+        return -1;
+    }
+
+    ptys = calloc(num_paths, sizeof(*ptys));
+    if (!ptys)
+        return -1;
+
+    for (i = 0; i < num_paths; i++) {
+        if (serve_pty_open(&ptys[i], pts_paths[i], dir, scrollback) < 0) {
+            num_paths = i + 1;
+            goto wrap_up;
+        }
+        printf("%s -> %s\n", ptys[i].path, ptys[i].sock_path);
+    }
+    fflush(stdout);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_sighandler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!serve_stop) {
+        int n = 0, live = 0;
+
+        for (i = 0; i < num_paths; i++)
+            n += 2 + ptys[i].num_clients;
+        if (n > max_pfd) {
+            struct pollfd *tmp = realloc(pfd, n * sizeof(*pfd));
+            if (!tmp)
+                goto wrap_up;
+            pfd = tmp;
+            max_pfd = n;
+        }
+
+        /* layout per pty: [slave][listener][client...] */
+        n = 0;
+        for (i = 0; i < num_paths; i++) {
+            struct serve_pty *p = &ptys[i];
+
+            pfd[n].fd = p->fd;
+            pfd[n++].events = POLLIN;
+            pfd[n].fd = p->listen_fd;
+            pfd[n++].events = POLLIN;
+            for (j = 0; j < p->num_clients; j++) {
+                pfd[n].fd = p->clients[j].fd;
+                pfd[n++].events = POLLIN |
+                    (p->clients[j].cursor < p->head ? POLLOUT : 0);
+            }
+            live += p->fd >= 0 || p->num_clients;
+        }
+        if (!live)
+            break;
+
+        if (poll(pfd, n, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            goto wrap_up;
+        }
+
+        n = 0;
+        for (i = 0; i < num_paths; i++) {
+            struct serve_pty *p = &ptys[i];
+            struct pollfd *cp = &pfd[n + 2];
+            int nc = p->num_clients;
+
+            if (pfd[n].revents && serve_fill(p) < 0) {
+                /* master closed: stop accepting, let clients drain */
+                close(p->fd);
+                p->fd = -1;
+                close(p->listen_fd);
+                unlink(p->sock_path);
+                p->listen_fd = -1;
+            }
+
+            /* walk backwards: dropping a client moves the last one down */
+            for (j = nc - 1; j >= 0; j--) {
+                struct serve_client *c = &p->clients[j];
+
+                if ((cp[j].revents & (POLLIN | POLLHUP | POLLERR))
+                    && serve_input(p, c) < 0) {
+                    serve_client_drop(p, j);
+                    continue;
+                }
+                if (serve_drain(p, c) < 0
+                    || (p->fd < 0 && c->cursor >= p->head)) {
+                    serve_client_drop(p, j);
+                    continue;
+                }
+            }
+
+            if (p->listen_fd >= 0 && pfd[n + 1].revents)
+                serve_accept(p);
+
+            n += 2 + nc;
+        }
+    }
+
+    ret = 0;
+
+wrap_up:
+    for (i = 0; i < num_paths; i++)
+        serve_pty_close(&ptys[i]);
+    free(ptys);
+    free(pfd);
+
+    return ret;
+}
@@ -0,0 +1,277 @@
+/*
+ * Copyright 2013
+ *  Steven Maresca <steve@zentific.com>
+ *  Zentific LLC
+ *
+ * fd_extract:
+ *  Take local copies of a target's file descriptors, so TIOCGPTN, TCGETS
+ *  and friends can be run here, as often as needed, with the target
+ *  running.
+ *
+ *  pidfd_getfd() does this without stopping anything. Kernels without it
+ *  (and fd tables not owned by the thread group leader, which a pidfd
+ *  cannot name) get one short stop instead: socket/sendmsg/close are
+ *  injected and every requested fd arrives here over SCM_RIGHTS in as
+ *  few messages as possible. No sacrificial child is forked. The socket
+ *  is open to anyone who can find its name, so only messages the kernel
+ *  credits to the target (SO_PASSCRED) are taken.
+ */
+
+#define _GNU_SOURCE             /* setns(), struct ucred */
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include "ptmx_resolve.h"
+#include "mytrace.h"
+
+#ifndef SYS_pidfd_open
+#   define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_getfd
+#   define SYS_pidfd_getfd 438
+#endif
+
+#define GRAB_MAX_FD 253         /* SCM_MAX_FD */
+
+int ptmx_socket_in_ns(long pid, int domain, int type, int protocol) {
+    struct stat ours, theirs;
+    char path[64];
+    int self_ns = -1, target_ns;
+    int fd;
+
+    /* sockets stay in the namespace they were created in, so a quick
+     * round trip through the target's is all it takes */
+    snprintf(path, sizeof(path), "/proc/%ld/ns/net", pid);
+    if (stat(path, &theirs) == 0 && stat("/proc/thread-self/ns/net", &ours) == 0
+        && theirs.st_ino != ours.st_ino) {
+        self_ns = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC);
+        target_ns = open(path, O_RDONLY | O_CLOEXEC);
+        if (self_ns < 0 || target_ns < 0
+            || setns(target_ns, CLONE_NEWNET) < 0) {
+            if (self_ns >= 0)
+                close(self_ns);
+            if (target_ns >= 0)
+                close(target_ns);
+            return -1;
+        }
+        close(target_ns);
+    }
+
+    fd = socket(domain, type | SOCK_CLOEXEC, protocol);
+
+    if (self_ns >= 0) {
+        /* stuck in the target's namespace, every socket this thread
+         * opens from now on would be theirs: there is no carrying on */
+        if (setns(self_ns, CLONE_NEWNET) < 0) {
+            fprintf(stderr, "%s - cannot return to our network namespace:"
+                    " %s\n", __FUNCTION__, strerror(errno));
+            abort();
+        }
+        close(self_ns);
+    }
+
+    return fd;
+}
+
+int ptmx_socket_in(long pid, int type) {
+    return ptmx_socket_in_ns(pid, AF_UNIX, type, 0);
+}
+
+static int grab_pidfd(long pid, int const *fds, int num_fds, int *local_fds) {
+    int pidfd;
+    int i;
+
+    pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0)
+        return -1;
+
+    for (i = 0; i < num_fds; i++) {
+        local_fds[i] = syscall(SYS_pidfd_getfd, pidfd, fds[i], 0);
+        if (local_fds[i] < 0 && errno != EBADF) {
+            /* ENOSYS, or not allowed: leave it to the ptrace path */
+            int err = errno;
+            while (i-- > 0)
+                close(local_fds[i]);
+            close(pidfd);
+            errno = err;
+            return -1;
+        }
+    }
+    close(pidfd);
+
+    return 0;
+}
+
+/* msghdr layouts differ for 32 bit targets under a 64 bit resolver */
+static int same_abi(long tid) {
+    unsigned char ident[EI_NIDENT];
+    char path[64];
+    int fd, ok;
+
+    snprintf(path, sizeof(path), "/proc/%ld/exe", tid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    ok = read(fd, ident, sizeof(ident)) == sizeof(ident)
+        && ident[EI_CLASS] == (sizeof(long) == 8 ? ELFCLASS64 : ELFCLASS32);
+    close(fd);
+
+    return ok;
+}
+
+static void close_cmsg_fds(struct cmsghdr *cmsg) {
+    int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+    for (int i = 0; i < n; i++)
+        close(((int *)CMSG_DATA(cmsg))[i]);
+}
+
+/* everything pid queued on s, in order, into local_fds; anything sent by
+ * anyone else is dropped, descriptors and all */
+static int recv_fds(int s, long pid, int *local_fds, int max_fds) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(struct ucred))
+                 + CMSG_SPACE(GRAB_MAX_FD * sizeof(int))];
+    } cbuf;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char data;
+    int got = 0;
+
+    for (;;) {
+        struct cmsghdr *rights = NULL;
+        struct ucred const *cred = NULL;
+        int n;
+
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = &data;
+        iov.iov_len = 1;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf.buf;
+        msg.msg_controllen = sizeof(cbuf.buf);
+
+        if (recvmsg(s, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC) < 0)
+            break;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET)
+                continue;
+            if (cmsg->cmsg_type == SCM_RIGHTS)
+                rights = cmsg;
+            else if (cmsg->cmsg_type == SCM_CREDENTIALS
+                     && cmsg->cmsg_len == CMSG_LEN(sizeof(*cred)))
+                cred = (struct ucred const *)CMSG_DATA(cmsg);
+        }
+        if (!rights)
+            continue;
+
+        if (!cred || cred->pid != pid || (msg.msg_flags & MSG_CTRUNC)) {
+            debug("dropping fds from pid %d, expected %ld",
+                  cred ? cred->pid : -1, pid);
+            close_cmsg_fds(rights);
+            continue;
+        }
+
+        n = (rights->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (n > max_fds - got) {
+            close_cmsg_fds(rights);
+            continue;
+        }
+        memcpy(local_fds + got, CMSG_DATA(rights), n * sizeof(int));
+        got += n;
+    }
+
+    return got;
+}
+
+static int grab_scm_rights(long pid, long tid, int const *fds, int num_fds,
+                           int *local_fds) {
+    struct sockaddr_un addr;
+    struct mytrace trace, *t = &trace;
+    socklen_t addrlen;
+    int s, done = 0;
+    int on = 1;
+
+    if (!same_abi(tid)) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    /* an autobound abstract address, in the target's network namespace */
+    s = ptmx_socket_in(pid, SOCK_DGRAM);
+    if (s < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    addrlen = sizeof(addr.sun_family);
+    if (bind(s, (struct sockaddr *)&addr, addrlen) < 0
+        || setsockopt(s, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0) {
+        close(s);
+        return -1;
+    }
+    addrlen = sizeof(addr);
+    getsockname(s, (struct sockaddr *)&addr, &addrlen);
+
+    if (mytrace_attach(t, tid) < 0) {
+        fprintf(stderr, "%s - cannot access process %ld\n", __FUNCTION__, tid);
+        close(s);
+        return -1;
+    }
+
+    /* a full receive queue stops the sender short: drain and go again */
+    while (done < num_fds) {
+        int sent = mytrace_sendfds(t, &addr, addrlen, fds + done,
+                                   num_fds - done);
+        int got;
+
+        if (sent <= 0)
+            break;
+        got = recv_fds(s, pid, local_fds + done, sent);
+        if (got != sent) {
+            debug("expected %d fds from tid %ld, got %d", sent, tid, got);
+            done += got;
+            break;
+        }
+        done += sent;
+    }
+
+    mytrace_detach(t);
+    close(s);
+
+    if (done < num_fds) {
+        while (done-- > 0)
+            close(local_fds[done]);
+        return -1;
+    }
+
+    return 0;
+}
+
+int ptsname_grab_fds(long pid, long tid, int const *fds, int num_fds,
+                     int *local_fds) {
+    if (num_fds <= 0)
+        return 0;
+
+    if (tid == pid && grab_pidfd(pid, fds, num_fds, local_fds) == 0)
+        return 0;
+
+    debug("pidfd_getfd not usable for %ld/%ld, using SCM_RIGHTS", pid, tid);
+
+    return grab_scm_rights(pid, tid, fds, num_fds, local_fds);
+}
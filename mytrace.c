@@ -14,14 +14,20 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <sys/ioctl.h>
 #include <sys/ptrace.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/un.h>
 #include <sys/user.h>
 #include <sys/wait.h>
 
@@ -32,8 +38,14 @@ static int memcpy_from_target(struct mytrace *t,
                               char *dest, long src, size_t n);
 static int memcpy_into_target(struct mytrace *t,
                               long dest, char const *src, size_t n);
-static long remote_syscall(struct mytrace *t, long call,
-                           long arg1, long arg2, long arg3);
+static long remote_syscall6(struct mytrace *t, long call,
+                            long arg1, long arg2, long arg3,
+                            long arg4, long arg5, long arg6);
+static long remote_syscall_timed(struct mytrace *t, long call,
+                                 long arg1, long arg2, long arg3,
+                                 long arg4, long arg5, long arg6);
+#define remote_syscall(t, call, arg1, arg2, arg3) \
+    remote_syscall_timed(t, call, arg1, arg2, arg3, 0, 0, 0)
 #   if defined DEBUG
 static void print_registers(pid_t pid);
 #   else
@@ -83,77 +95,97 @@ static void print_registers(pid_t pid);
 #define MYCALL_EXIT     8
 #define MYCALL_EXECVE   9
 #define MYCALL_IOCTL   10
+#define MYCALL_MMAP    11
+#define MYCALL_MUNMAP  12
+#define MYCALL_MPROTECT 13
+#define MYCALL_SOCKET  14
+#define MYCALL_SENDMSG 15
 
 #if defined __x86_64__
 /* from unistd_32.h on an amd64 system */
-int syscalls32[] = { 5, 6, 4, 63, 57, 66, 37, 2, 1, 11, 54 };
+static int const syscalls32[] = { 5, 6, 4, 63, 57, 66, 37, 2, 1, 11, 54, 192,
+    91, 125, 359, 370 };
 
-int syscalls64[] =
+#   define SYS_MYMMAP SYS_mmap
+static int const syscalls64[] =
 #else
-int syscalls32[] =
+#   define SYS_MYMMAP SYS_mmap2 /* old_mmap takes a struct */
+static int const syscalls32[] =
 #endif
 { SYS_open, SYS_close, SYS_write, SYS_dup2, SYS_setpgid, SYS_setsid,
-    SYS_kill, SYS_fork, SYS_exit, SYS_execve, SYS_ioctl
+    SYS_kill, SYS_fork, SYS_exit, SYS_execve, SYS_ioctl, SYS_MYMMAP,
+    SYS_munmap, SYS_mprotect, SYS_socket, SYS_sendmsg
 };
 
-char const *syscallnames[] =
+static char const *const syscallnames[] =
     { "open", "close", "write", "dup2", "setpgid", "setsid", "kill", "fork",
-    "exit", "execve", "ioctl"
+    "exit", "execve", "ioctl", "mmap", "munmap", "mprotect", "socket",
+    "sendmsg"
 };
 
-struct mytrace
+/* Scratch for data passed to and from the target, one chunk at a time */
+#define MYTRACE_CHUNK 256
+
+static long mytrace_usec(void)
 {
-    pid_t pid, child;
-};
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-struct mytrace *mytrace_attach(long int pid)
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+int mytrace_attach(struct mytrace *t, long int pid)
 {
-    struct mytrace *t;
+    long tgid, start;
     int status;
 
+    /* may wait for a free slot or for the target's budget to refill */
+    tgid = ptsname_budget_enter(pid);
+    start = mytrace_usec();
+
     if (ptrace(PTRACE_ATTACH, pid, 0, 0) < 0)
     {
         perror("PTRACE_ATTACH (attach)");
-        return NULL;
+        ptsname_budget_leave(tgid, 0, 0);
+        return -1;
     }
     if (waitpid(pid, &status, 0) < 0)
     {
         perror("waitpid");
-        return NULL;
+        ptsname_budget_leave(tgid, 0, 0);
+        return -1;
     }
     if (!WIFSTOPPED(status))
     {
         fprintf(stderr, "traced process was not stopped\n");
         ptrace(PTRACE_DETACH, pid, 0, 0);
-        return NULL;
+        ptsname_budget_leave(tgid, 0, 0);
+        return -1;
     }
 
-    t = malloc(sizeof(struct mytrace));
     t->pid = pid;
     t->child = 0;
+    t->owner = t;
+    t->budget_tgid = tgid;
+    t->stopped_at = start;
+    t->charged = 0;
 
-    return t;
-}
-
-struct mytrace *mytrace_fork(struct mytrace *t)
-{
-    struct mytrace *child;
-
-    ptrace(PTRACE_SETOPTIONS, t->pid, NULL, PTRACE_O_TRACEFORK);
-    remote_syscall(t, MYCALL_FORK, 0, 0, 0);
-    waitpid(t->child, NULL, 0);
-
-    child = malloc(sizeof(struct mytrace));
-    child->pid = t->child;
-    child->child = 0;
-
-    return child;
+    return 0;
 }
 
 int mytrace_detach(struct mytrace *t)
 {
+    long total;
+
     ptrace(PTRACE_DETACH, t->pid, 0, 0);
-    free(t);
+
+    if (t->budget_tgid)
+    {
+        total = mytrace_usec() - t->stopped_at;
+        ptsname_budget_leave(t->budget_tgid, total - t->charged, total);
+        t->budget_tgid = 0;
+    }
 
     return 0;
 }
@@ -165,11 +197,17 @@ long mytrace_getpid(struct mytrace *t)
 
 int mytrace_open(struct mytrace *t, char const *path, int mode)
 {
-    char backup_data[4096];
+    char backup_data[PATH_MAX];
     struct user_regs_struct regs;
     size_t size = strlen(path) + 1;
     int ret, err;
 
+    if (size > sizeof(backup_data))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
     if (ptrace(PTRACE_GETREGS, t->pid, NULL, &regs) < 0)
     {
         perror("PTRACE_GETREGS (open)\n");
@@ -182,7 +220,7 @@ int mytrace_open(struct mytrace *t, char const *path, int mode)
 
     memcpy_into_target(t, regs.RSP, path, size);
 
-    ret = remote_syscall(t, MYCALL_OPEN, regs.RSP, O_RDWR, 0755);
+    ret = remote_syscall(t, MYCALL_OPEN, regs.RSP, mode, 0755);
     err = errno;
 
     /* Restore the data */
@@ -199,9 +237,11 @@ int mytrace_close(struct mytrace *t, int fd)
 
 int mytrace_write(struct mytrace *t, int fd, char const *data, size_t len)
 {
+    char backup_data[MYTRACE_CHUNK];
     struct user_regs_struct regs;
-    char *backup_data;
-    int ret, err;
+    size_t chunk = len < MYTRACE_CHUNK ? len : MYTRACE_CHUNK;
+    size_t done = 0;
+    int ret = 0, err = 0;
 
     if (ptrace(PTRACE_GETREGS, t->pid, NULL, &regs) < 0)
     {
@@ -209,22 +249,39 @@ int mytrace_write(struct mytrace *t, int fd, char const *data, size_t len)
         return -1;
     }
 
-    backup_data = malloc(len);
-
     /* Backup the data that we will use */
-    if (memcpy_from_target(t, backup_data, regs.RSP, len) < 0)
+    if (memcpy_from_target(t, backup_data, regs.RSP, chunk) < 0)
         return -1;
 
-    memcpy_into_target(t, regs.RSP, data, len);
+    /* one chunk at a time through the same spot */
+    while (done < len)
+    {
+        size_t n = len - done < chunk ? len - done : chunk;
 
-    ret = remote_syscall(t, MYCALL_WRITE, fd, regs.RSP, len);
-    err = errno;
+        if (memcpy_into_target(t, regs.RSP, data + done, n) < 0)
+        {
+            ret = -1;
+            err = errno;
+            break;
+        }
+        ret = remote_syscall(t, MYCALL_WRITE, fd, regs.RSP, n);
+        if (ret <= 0)
+        {
+            err = errno;
+            break;
+        }
+        done += ret;
+    }
 
     /* Restore the data */
-    memcpy_into_target(t, regs.RSP, backup_data, len);
+    memcpy_into_target(t, regs.RSP, backup_data, chunk);
 
-    errno = err;
-    return ret;
+    if (done == 0 && ret < 0)
+    {
+        errno = err;
+        return -1;
+    }
+    return done;
 }
 
 int mytrace_dup2(struct mytrace *t, int oldfd, int newfd)
@@ -253,16 +310,53 @@ int mytrace_exit(struct mytrace *t, int status)
     return remote_syscall(t, MYCALL_EXIT, status, 0, 0);
 }
 
+/* Copy the target's environment strings to dest in chunks; with ptrs,
+ * write a pointer to each string (as it will be at dest) there instead */
+static long copy_environ(struct mytrace *t, long dest, long ptrs)
+{
+    char envpath[64], chunk[MYTRACE_CHUNK];
+    long done = 0;
+    int at_start = 1;
+    ssize_t r;
+    int fd;
+
+    snprintf(envpath, sizeof(envpath), "/proc/%d/environ", t->pid);
+    fd = open(envpath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    /* stable: the target is stopped the whole time */
+    while ((r = read(fd, chunk, sizeof(chunk))) > 0)
+    {
+        if (!ptrs && memcpy_into_target(t, dest + done, chunk, r) < 0)
+            break;
+        for (ssize_t i = 0; ptrs && i < r; i++)
+        {
+            if (at_start)
+            {
+                long p = dest + done + i;
+
+                memcpy_into_target(t, ptrs, (char *)&p, sizeof(p));
+                ptrs += sizeof(p);
+            }
+            at_start = chunk[i] == '\0';
+        }
+        done += r;
+    }
+    close(fd);
+    if (r != 0)
+        return -1;
+
+    return ptrs ? ptrs : done;
+}
+
 int mytrace_exec(struct mytrace *t, char const *command)
 {
     struct user_regs_struct regs;
-    char *env, *p;
     long p2, envaddr, argvaddr, envptraddr;
-    char envpath[PATH_MAX + 1];
-    ssize_t envsize = 16 * 1024;
-    int ret, fd, l, l2;
+    long envsize, end;
+    int ret, l, l2;
     char *nullp = NULL;
-    ssize_t r;
 
     ptrace(PTRACE_SETOPTIONS, t->pid, NULL, PTRACE_O_TRACEEXEC);
 
@@ -273,32 +367,7 @@ int mytrace_exec(struct mytrace *t, char const *command)
     }
 
     debug("PTRACE_GETREGS done");
-    env = malloc(envsize);
-    if (!env)
-        return -1;
 
-    snprintf(envpath, PATH_MAX, "/proc/%d/environ", t->pid);
-
-    fd = open(envpath, O_RDONLY);
-    if (fd == -1)
-        return -1;
-    r = read(fd, env, envsize);
-    close(fd);
-    if (r == -1)
-        return -1;
-    while (r == envsize)
-    {
-        free(env);
-        env = malloc(envsize);
-        if (!env)
-            return -1;
-        fd = open(envpath, O_RDONLY);
-        r = read(fd, env, envsize);
-        close(fd);
-        if (r == -1)
-            return -1;
-    }
-    envsize = r;
     l2 = sizeof(char *);        /* Size of a pointer */
     p2 = regs.RSP;
 
@@ -316,24 +385,20 @@ int mytrace_exec(struct mytrace *t, char const *command)
     memcpy_into_target(t, p2, (char *)&nullp, l2);
     p2 += l2;
 
-    /* Third argument is the environment */
+    /* Third argument is the environment, streamed from /proc */
     /* First, copy all the strings */
-    memcpy_into_target(t, p2, env, envsize);
     envaddr = p2;
+    envsize = copy_environ(t, envaddr, 0);
+    if (envsize < 0)
+        return -1;
     p2 += envsize;
     /* Then write an array of pointers to the strings */
     envptraddr = p2;
-    p = env;
-    while (p < env + envsize)
-    {
-        long diffp = p - env + envaddr;
-        memcpy_into_target(t, p2, (char *)&diffp, l2);
-        p2 += l2;
-        p += strlen(p) + 1;
-    }
+    end = copy_environ(t, envaddr, envptraddr);
+    if (end < 0)
+        return -1;
     /* And have a NULL pointer at the end of the array */
-    memcpy_into_target(t, p2, (char *)&nullp, l2);
-    free(env);
+    memcpy_into_target(t, end, (char *)&nullp, l2);
 
     ret = remote_syscall(t, MYCALL_EXECVE, regs.RSP, argvaddr, envptraddr);
 
@@ -343,7 +408,7 @@ int mytrace_exec(struct mytrace *t, char const *command)
 /* Added 2013-09-17 by S. Maresca */
 int mytrace_TIOCGPTN(struct mytrace *t, int fd, int *pts)
 {
-    char backup_data[4096];
+    char backup_data[sizeof(int)];
     struct user_regs_struct regs;
     size_t size = sizeof(int);
     int ret, err;
@@ -369,9 +434,107 @@ int mytrace_TIOCGPTN(struct mytrace *t, int fd, int *pts)
     errno = err;
     return ret;
 }
+/*
+ * Pass fds of the target to the unix datagram socket at addr, up to
+ * SCM_MAX_FD per message. Uses socket/sendmsg/close in the target only,
+ * with the message built below its stack. Returns how many fds went out;
+ * fewer than num_fds means the receiver's queue filled up.
+ */
+#define MYTRACE_SCM_MAX_FD 253
+
+int mytrace_sendfds(struct mytrace *t, struct sockaddr_un const *addr,
+                    socklen_t addrlen, int const *fds, int num_fds)
+{
+    struct
+    {
+        struct sockaddr_un addr;
+        struct msghdr msg;
+        struct iovec iov;
+        long data;
+        union
+        {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(MYTRACE_SCM_MAX_FD * sizeof(int))];
+        } cmsg;
+    } blob, backup_data;
+    struct user_regs_struct regs;
+    struct cmsghdr *cmsg;
+    long base;
+    int s, sent = 0;
+    int ret, err = 0;
+
+    if (ptrace(PTRACE_GETREGS, t->pid, NULL, &regs) < 0)
+    {
+        perror("PTRACE_GETREGS (sendfds)\n");
+        return -1;
+    }
+
+    /* below the red zone, so nothing live on the stack is touched */
+    base = (regs.RSP - 128 - sizeof(blob)) & ~15L;
+
+    if (memcpy_from_target(t, (char *)&backup_data, base, sizeof(blob)) < 0)
+        return -1;
+
+    s = remote_syscall(t, MYCALL_SOCKET, AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (s < 0)
+        return -1;
+
+    while (sent < num_fds)
+    {
+        int n = num_fds - sent;
+
+        if (n > MYTRACE_SCM_MAX_FD)
+            n = MYTRACE_SCM_MAX_FD;
+
+        memset(&blob, 0, sizeof(blob));
+        blob.addr = *addr;
+        blob.iov.iov_base = (void *)(base + offsetof(typeof(blob), data));
+        blob.iov.iov_len = 1;
+        blob.msg.msg_name = (void *)(base + offsetof(typeof(blob), addr));
+        blob.msg.msg_namelen = addrlen;
+        blob.msg.msg_iov = (void *)(base + offsetof(typeof(blob), iov));
+        blob.msg.msg_iovlen = 1;
+        blob.msg.msg_control = (void *)(base + offsetof(typeof(blob), cmsg));
+        blob.msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+
+        /* CMSG_FIRSTHDR needs a local msghdr pointing at local memory */
+        struct msghdr local = { .msg_control = blob.cmsg.buf,
+                                .msg_controllen = blob.msg.msg_controllen };
+        cmsg = CMSG_FIRSTHDR(&local);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds + sent, n * sizeof(int));
+
+        if (memcpy_into_target(t, base, (char *)&blob, sizeof(blob)) < 0)
+            break;
+
+        ret = remote_syscall(t, MYCALL_SENDMSG, s,
+                             base + offsetof(typeof(blob), msg), MSG_DONTWAIT);
+        if (ret < 0)
+        {
+            err = errno;
+            break;
+        }
+        sent += n;
+    }
+
+    remote_syscall(t, MYCALL_CLOSE, s, 0, 0);
+
+    /* Restore the data */
+    memcpy_into_target(t, base, (char *)&backup_data, sizeof(blob));
+
+    if (sent == 0 && err)
+    {
+        errno = err;
+        return -1;
+    }
+    return sent;
+}
+
 int mytrace_tcgets(struct mytrace *t, int fd, struct termios *tos)
 {
-    char backup_data[4096];
+    char backup_data[sizeof(struct termios)];
     struct user_regs_struct regs;
     size_t size = sizeof(struct termios);
     int ret, err;
@@ -400,7 +563,7 @@ int mytrace_tcgets(struct mytrace *t, int fd, struct termios *tos)
 
 int mytrace_tcsets(struct mytrace *t, int fd, struct termios *tos)
 {
-    char backup_data[4096];
+    char backup_data[sizeof(struct termios)];
     struct user_regs_struct regs;
     size_t size = sizeof(struct termios);
     int ret, err;
@@ -433,6 +596,90 @@ int mytrace_sctty(struct mytrace *t, int fd)
     return remote_syscall(t, MYCALL_IOCTL, fd, TIOCSCTTY, 0);
 }
 
+long mytrace_mmap(struct mytrace *t, long addr, size_t len, int prot,
+                  int flags, int fd, long off)
+{
+    return remote_syscall_timed(t, MYCALL_MMAP, addr, len, prot, flags, fd,
+                                off);
+}
+
+int mytrace_munmap(struct mytrace *t, long addr, size_t len)
+{
+    return remote_syscall(t, MYCALL_MUNMAP, addr, len, 0);
+}
+
+int mytrace_mprotect(struct mytrace *t, long addr, size_t len, int prot)
+{
+    return remote_syscall(t, MYCALL_MPROTECT, addr, len, prot);
+}
+
+int mytrace_poke(struct mytrace *t, long dest, void const *src, size_t n)
+{
+    return memcpy_into_target(t, dest, src, n);
+}
+
+/*
+ * Run code already placed in the target at addr, with two arguments and
+ * its own stack, until it executes int3. Returns what it left in rax.
+ * Must follow a remote syscall, so the thread sits on a syscall boundary.
+ */
+long mytrace_call(struct mytrace *t, long addr, long arg1, long arg2, long sp)
+{
+#if defined __x86_64__
+    struct user_regs_struct regs, oldregs;
+    int status, sig = 0;
+
+    if (ptrace(PTRACE_GETREGS, t->pid, NULL, &oldregs) < 0)
+    {
+        perror("PTRACE_GETREGS (call)\n");
+        return -1;
+    }
+
+    regs = oldregs;
+    regs.rip = addr;
+    regs.rdi = arg1;
+    regs.rsi = arg2;
+    regs.rsp = sp;
+    /* we are not in a syscall: keep the kernel from restarting one */
+    regs.orig_rax = -1;
+
+    if (ptrace(PTRACE_SETREGS, t->pid, NULL, &regs) < 0)
+    {
+        perror("PTRACE_SETREGS (call)\n");
+        return -1;
+    }
+
+    for (;;)
+    {
+        if (ptrace(PTRACE_CONT, t->pid, NULL, sig) < 0)
+        {
+            perror("PTRACE_CONT (call)\n");
+            return -1;
+        }
+        if (waitpid(t->pid, &status, 0) < 0 || !WIFSTOPPED(status))
+            return -1;
+        if (WSTOPSIG(status) == SIGTRAP)
+            break;
+        /* not ours: pass it on, the handler returns into our code */
+        sig = WSTOPSIG(status);
+    }
+
+    if (ptrace(PTRACE_GETREGS, t->pid, NULL, &regs) < 0
+        || ptrace(PTRACE_SETREGS, t->pid, NULL, &oldregs) < 0)
+    {
+        perror("PTRACE_SETREGS (call)\n");
+        return -1;
+    }
+
+    debug("call 0x%lx returned %ld", addr, (long)regs.rax);
+
+    return regs.rax;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
 /*
  * XXX: the following functions are local
  */
@@ -503,8 +750,9 @@ static int memcpy_into_target(struct mytrace *t,
     return 0;
 }
 
-static long remote_syscall(struct mytrace *t, long call,
-                           long arg1, long arg2, long arg3)
+static long remote_syscall6(struct mytrace *t, long call,
+                            long arg1, long arg2, long arg3,
+                            long arg4, long arg5, long arg6)
 {
     /* Method for remote syscall: - wait until the traced application exits
        from a syscall - save registers - rewind eip/rip to point on the
@@ -522,8 +770,8 @@ static long remote_syscall(struct mytrace *t, long call,
         return -1;
     }
 
-    debug("remote syscall %s(0x%lx, 0x%lx, 0x%lx)",
-          syscallnames[call], arg1, arg2, arg3);
+    debug("remote syscall %s(0x%lx, 0x%lx, 0x%lx, 0x%lx, 0x%lx, 0x%lx)",
+          syscallnames[call], arg1, arg2, arg3, arg4, arg5, arg6);
 
 #if defined __x86_64__
     bits = 64;
@@ -585,6 +833,9 @@ static long remote_syscall(struct mytrace *t, long call,
         regs.RDI = arg1;
         regs.RSI = arg2;
         regs.RDX = arg3;
+        regs.r10 = arg4;
+        regs.r8 = arg5;
+        regs.r9 = arg6;
     }
     else
 #endif
@@ -593,6 +844,9 @@ static long remote_syscall(struct mytrace *t, long call,
         regs.RBX = arg1;
         regs.RCX = arg2;
         regs.RDX = arg3;
+        regs.RSI = arg4;
+        regs.RDI = arg5;
+        regs.RBP = arg6;
     }
 
     if (ptrace(PTRACE_SETREGS, t->pid, NULL, &regs) < 0)
@@ -670,6 +924,28 @@ static long remote_syscall(struct mytrace *t, long call,
     return regs.RAX;
 }
 
+/* Every injected syscall is charged to the stop it belongs to right away,
+ * so the stop budget sees a slow target before the stop is even over */
+static long remote_syscall_timed(struct mytrace *t, long call,
+                                 long arg1, long arg2, long arg3,
+                                 long arg4, long arg5, long arg6)
+{
+    struct mytrace *owner = t->owner;
+    long start, usec, ret;
+
+    start = mytrace_usec();
+    ret = remote_syscall6(t, call, arg1, arg2, arg3, arg4, arg5, arg6);
+    usec = mytrace_usec() - start;
+
+    if (owner && owner->budget_tgid)
+    {
+        ptsname_budget_charge(owner->budget_tgid, usec);
+        owner->charged += usec;
+    }
+
+    return ret;
+}
+
 /* For debugging purposes only. Prints register and stack information. */
 #if defined DEBUG
 static void print_registers(pid_t pid)
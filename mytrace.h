@@ -11,11 +11,21 @@
  */
 
 #include <termios.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
 
-struct mytrace;
+/* Caller owned (on the stack, typically); nothing here is allocated */
+struct mytrace
+{
+    pid_t pid, child;
+    struct mytrace *owner;      /* the attach whose stop this is part of */
+    long budget_tgid;           /* stop_budget admission, 0 if unpaced */
+    long stopped_at;            /* usec */
+    long charged;               /* usec already reported while stopped */
+};
 
-struct mytrace* mytrace_attach(long int pid);
-struct mytrace* mytrace_fork(struct mytrace *t);
+int mytrace_attach(struct mytrace *t, long int pid);
 int mytrace_detach(struct mytrace *t);
 long mytrace_getpid(struct mytrace *t);
 
@@ -32,3 +42,11 @@ int mytrace_tcgets(struct mytrace *t, int fd, struct termios *tos);
 int mytrace_tcsets(struct mytrace *t, int fd, struct termios *tos);
 int mytrace_sctty(struct mytrace *t, int fd);
 int mytrace_TIOCGPTN(struct mytrace *t, int fd, int *pts);
+long mytrace_mmap(struct mytrace *t, long addr, size_t len, int prot,
+                  int flags, int fd, long off);
+int mytrace_munmap(struct mytrace *t, long addr, size_t len);
+int mytrace_mprotect(struct mytrace *t, long addr, size_t len, int prot);
+int mytrace_poke(struct mytrace *t, long dest, void const *src, size_t n);
+long mytrace_call(struct mytrace *t, long addr, long arg1, long arg2, long sp);
+int mytrace_sendfds(struct mytrace *t, struct sockaddr_un const *addr,
+                    socklen_t addrlen, int const *fds, int num_fds);
@@ -0,0 +1,254 @@
+/*
+ * Copyright 2013
+ *  Steven Maresca <steve@zentific.com>
+ *  Zentific LLC
+ *
+ * probe_standin:
+ *  The app_probe protocols against stand-ins, with no QEMU or tmux on the
+ *  machine: a scripted QMP server on a socket in a scratch directory, and
+ *  a fake tmux client (a shell script) with a listening socket for it to
+ *  be pointed at. Each case says what the probe should make of the
+ *  replies; the exit status is the number of cases that failed.
+ *
+ *  ./probe_standin
+ */
+
+#define _GNU_SOURCE             /* mkdtemp() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "ptmx_resolve.h"
+
+#define QMP_GREETING "{\"QMP\": {\"version\": {\"qemu\": {\"micro\": 0, " \
+                     "\"minor\": 2, \"major\": 8}}, \"capabilities\": []}}\n"
+#define QMP_EVENT    "{\"timestamp\": {\"seconds\": 1, \"microseconds\": 2}, " \
+                     "\"event\": \"NIC_RX_FILTER_CHANGED\"}\n"
+
+/* what the stand-in QMP server says on each connection, in order */
+static struct qmp_script {
+    char const *name;
+    char const *greeting;
+    char const *capabilities;
+    char const *chardevs;
+    int expect;                 /* ptys the probe should report, -1: fail */
+    int pts[4];
+    char const *labels[4];
+} const qmp_scripts[] = {
+    {
+        "qmp: ptys among other chardevs, an event in between",
+        QMP_GREETING,
+        QMP_EVENT "{\"return\": {}}\n",
+        "{\"return\": [{\"frontend-open\": true, \"filename\": "
+        "\"pty:/dev/pts/3\", \"label\": \"serial0\"}, {\"frontend-open\": "
+        "false, \"filename\": \"unix:/run/qmp.sock,server=on\", \"label\": "
+        "\"compat_monitor0\"}, {\"frontend-open\": true, \"filename\": "
+        "\"pty:/dev/pts/12\", \"label\": \"charchannel0\"}, "
+        "{\"frontend-open\": true, \"filename\": \"pty:/dev/pts/3\", "
+        "\"label\": \"serial1\"}]}\n",
+        2, { 3, 12 }, { "serial0", "charchannel0" },
+    },
+    {
+        "qmp: no pty chardevs",
+        QMP_GREETING,
+        "{\"return\": {}}\n",
+        "{\"return\": [{\"frontend-open\": false, \"filename\": \"null\", "
+        "\"label\": \"parallel0\"}]}\n",
+        0, { 0 }, { NULL },
+    },
+    {
+        "qmp: query-chardev refused",
+        QMP_GREETING,
+        "{\"return\": {}}\n",
+        "{\"error\": {\"class\": \"CommandNotFound\", \"desc\": \"no\"}}\n",
+        -1, { 0 }, { NULL },
+    },
+    {
+        "qmp: not a QMP greeting",
+        "SSH-2.0-OpenSSH_9.6\r\n",
+        NULL,
+        NULL,
+        -1, { 0 }, { NULL },
+    },
+};
+
+#define NUM_QMP_SCRIPTS (int)(sizeof(qmp_scripts) / sizeof(qmp_scripts[0]))
+
+static int failures;
+
+/* a listening socket at path */
+static int listen_at(char const *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int s;
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s < 0 || bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(s, 4) < 0) {
+        perror(path);
+        if (s >= 0)
+            close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+/* one line from the client, whatever it is; 0 at its end */
+static int read_line(int c) {
+    char ch;
+
+    while (read(c, &ch, 1) == 1) {
+        if (ch == '\n')
+            return 1;
+    }
+
+    return 0;
+}
+
+static void say(int c, char const *text) {
+    if (text && write(c, text, strlen(text)) < 0)
+        _exit(1);
+}
+
+/* the stand-in QEMU: one connection per script, then it is done */
+static void qmp_server(int s) {
+    for (int i = 0; i < NUM_QMP_SCRIPTS; i++) {
+        struct qmp_script const *q = &qmp_scripts[i];
+        int c = accept(s, NULL, NULL);
+
+        if (c < 0)
+            _exit(1);
+        say(c, q->greeting);
+        if (q->capabilities && read_line(c)) {
+            say(c, q->capabilities);
+            if (q->chardevs && read_line(c))
+                say(c, q->chardevs);
+        }
+        close(c);
+    }
+    _exit(0);
+}
+
+static void check(char const *name, int num, struct ptsname_probe_pty *ptys,
+                  int expect, int const *pts, char const *const *labels) {
+    int ok = num == expect;
+
+    for (int i = 0; ok && i < num; i++)
+        ok = ptys[i].pts == pts[i] && !strcmp(ptys[i].label, labels[i]);
+
+    printf("%-4s %s: %d", ok ? "ok" : "FAIL", name, num);
+    for (int i = 0; i < num; i++)
+        printf(" %d=%s", ptys[i].pts, ptys[i].label);
+    printf("\n");
+    failures += !ok;
+}
+
+static void qmp_cases(char const *dir) {
+    struct ptsname_probe_pty ptys[16];
+    char path[PATH_MAX];
+    pid_t server;
+    int s;
+
+    snprintf(path, sizeof(path), "%s/qmp.sock", dir);
+    s = listen_at(path);
+    if (s < 0) {
+        failures++;
+        return;
+    }
+    server = fork();
+    if (server == 0)
+        qmp_server(s);
+    close(s);
+
+    for (int i = 0; i < NUM_QMP_SCRIPTS; i++) {
+        struct qmp_script const *q = &qmp_scripts[i];
+
+        check(q->name, ptsname_probe_qmp(0, path, ptys, 16), ptys, q->expect,
+              q->pts, q->labels);
+    }
+
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+}
+
+/* a fake tmux client that prints what list-panes would, or fails */
+static int fake_tmux(char const *path, char const *output, int status) {
+    FILE *f;
+
+    f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    fprintf(f, "#!/bin/sh\n"
+            "[ \"$1\" = -S ] && [ \"$3\" = list-panes ] || exit 2\n"
+            "printf '%s'\n"
+            "exit %d\n", output, status);
+    fclose(f);
+
+    return chmod(path, 0700);
+}
+
+static void tmux_cases(char const *dir) {
+    static int const pts[] = { 4, 9 };
+    static char const *const labels[] = { "main:0.0", "main:1.0" };
+    struct ptsname_probe_pty ptys[16];
+    char sock[PATH_MAX], client[PATH_MAX];
+    int s;
+
+    snprintf(sock, sizeof(sock), "%s/tmux.sock", dir);
+    snprintf(client, sizeof(client), "%s/tmux", dir);
+    s = listen_at(sock);
+    if (s < 0) {
+        failures++;
+        return;
+    }
+
+    if (fake_tmux(client, "/dev/pts/4 main:0.0\\n/dev/pts/9 main:1.0\\n"
+                  "/dev/pts/4 main:0.1\\nnot-a-pty x:0.0\\n", 0) == 0)
+        check("tmux: panes, one pty shared", ptsname_probe_tmux(0, sock,
+              client, ptys, 16), ptys, 2, pts, labels);
+    if (fake_tmux(client, "", 1) == 0)
+        check("tmux: no server running", ptsname_probe_tmux(0, sock, client,
+              ptys, 16), ptys, -1, NULL, NULL);
+    check("tmux: own client for a live pid", ptsname_probe_tmux(getpid(),
+          sock, client, ptys, 16), ptys, -1, NULL, NULL);
+
+    close(s);
+}
+
+int main(void) {
+    char dir[] = "/tmp/probe_standin.XXXXXX";
+    char path[PATH_MAX];
+
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    qmp_cases(dir);
+    tmux_cases(dir);
+
+    snprintf(path, sizeof(path), "%s/qmp.sock", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/tmux.sock", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/tmux", dir);
+    unlink(path);
+    rmdir(dir);
+
+    printf("%d failed\n", failures);
+
+    return failures;
+}
@@ -0,0 +1,333 @@
+/*
+ * Copyright 2013
+ *  Steven Maresca <steve@zentific.com>
+ *  Zentific LLC
+ *
+ * proc_parse:
+ *  Field scanners for /proc text (fdinfo, status, stat, mountinfo).
+ *
+ *  Host-wide modes parse a few small files per process, tens of thousands
+ *  of times per sweep, and sscanf()/strstr() spend most of that on
+ *  generality. These only do what the formats need: find a "key:" at the
+ *  start of a line, step over N space separated fields, read a decimal.
+ *  Key search and field skipping look at 32 (AVX2) or 16 (SSE2) bytes a
+ *  step on x86; elsewhere, and for the tails, plain loops do the same. Key
+ *  search ends on one more block, overlapping the last, instead: in an
+ *  fdinfo the key sits in that tail, and a byte loop there was slower than
+ *  strstr(). bench_proc_parse times each against the plain loops.
+ *  Directories are read with getdents64() into a caller-owned buffer.
+ */
+
+#define _GNU_SOURCE             /* memrchr() */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#if defined __x86_64__ || defined __i386__
+#   include <immintrin.h>
+#endif
+
+#include "ptmx_resolve.h"
+
+/* candidate positions of key: first and last byte both match */
+static char const *find_scalar(char const *s, size_t n, char const *k,
+                               size_t kn) {
+    for (size_t i = 0; i + kn <= n; i++) {
+        if (s[i] == k[0] && s[i + kn - 1] == k[kn - 1]
+            && !memcmp(s + i + 1, k + 1, kn - 2))
+            return s + i;
+    }
+
+    return NULL;
+}
+
+static char const *skip_scalar(char const *p, char const *end, int n) {
+    for (; p < end; p++) {
+        if (*p == ' ' && --n == 0)
+            return p + 1;
+    }
+
+    return NULL;
+}
+
+#if defined __SSE2__
+
+static char const *find_sse2(char const *s, size_t n, char const *k,
+                             size_t kn) {
+    __m128i first = _mm_set1_epi8(k[0]);
+    __m128i last = _mm_set1_epi8(k[kn - 1]);
+    size_t i = 0;
+
+    for (; i + kn - 1 + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((__m128i const *)(s + i));
+        __m128i b = _mm_loadu_si128((__m128i const *)(s + i + kn - 1));
+        unsigned int mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+
+            if (!memcmp(s + i + bit + 1, k + 1, kn - 2))
+                return s + i + bit;
+            mask &= mask - 1;
+        }
+    }
+
+    /* the tail as one more block, ending at the last position, with the
+     * positions already looked at masked off */
+    if (i > 0 && i + kn - 1 < n) {
+        size_t j = n - (kn - 1) - 16;
+        __m128i a = _mm_loadu_si128((__m128i const *)(s + j));
+        __m128i b = _mm_loadu_si128((__m128i const *)(s + j + kn - 1));
+        unsigned int mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+        mask &= ~0u << (i - j);
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+
+            if (!memcmp(s + j + bit + 1, k + 1, kn - 2))
+                return s + j + bit;
+            mask &= mask - 1;
+        }
+        return NULL;
+    }
+
+    return find_scalar(s + i, n - i, k, kn);
+}
+
+static char const *skip_sse2(char const *p, char const *end, int n) {
+    __m128i space = _mm_set1_epi8(' ');
+
+    for (; p + 16 <= end; p += 16) {
+        unsigned int mask = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((__m128i const *)p), space));
+        int c = __builtin_popcount(mask);
+
+        if (c < n) {
+            n -= c;
+            continue;
+        }
+        /* the n-th space of this block */
+        while (--n)
+            mask &= mask - 1;
+        return p + __builtin_ctz(mask) + 1;
+    }
+
+    return skip_scalar(p, end, n);
+}
+
+__attribute__((target("avx2")))
+static char const *find_avx2(char const *s, size_t n, char const *k,
+                             size_t kn) {
+    __m256i first = _mm256_set1_epi8(k[0]);
+    __m256i last = _mm256_set1_epi8(k[kn - 1]);
+    size_t i = 0;
+
+    for (; i + kn - 1 + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((__m256i const *)(s + i));
+        __m256i b = _mm256_loadu_si256((__m256i const *)(s + i + kn - 1));
+        unsigned int mask = _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                             _mm256_cmpeq_epi8(b, last)));
+
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+
+            if (!memcmp(s + i + bit + 1, k + 1, kn - 2))
+                return s + i + bit;
+            mask &= mask - 1;
+        }
+    }
+
+    if (i > 0 && i + kn - 1 < n) {
+        size_t j = n - (kn - 1) - 32;
+        __m256i a = _mm256_loadu_si256((__m256i const *)(s + j));
+        __m256i b = _mm256_loadu_si256((__m256i const *)(s + j + kn - 1));
+        unsigned int mask = _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                             _mm256_cmpeq_epi8(b, last)));
+
+        mask &= ~0u << (i - j);
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+
+            if (!memcmp(s + j + bit + 1, k + 1, kn - 2))
+                return s + j + bit;
+            mask &= mask - 1;
+        }
+        return NULL;
+    }
+
+    return find_sse2(s + i, n - i, k, kn);
+}
+
+__attribute__((target("avx2,popcnt")))
+static char const *skip_avx2(char const *p, char const *end, int n) {
+    __m256i space = _mm256_set1_epi8(' ');
+
+    for (; p + 32 <= end; p += 32) {
+        unsigned int mask = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i const *)p), space));
+        int c = __builtin_popcount(mask);
+
+        if (c < n) {
+            n -= c;
+            continue;
+        }
+        while (--n)
+            mask &= mask - 1;
+        return p + __builtin_ctz(mask) + 1;
+    }
+
+    return skip_sse2(p, end, n);
+}
+
+static int have_avx2(void) {
+    static int avx2 = -1;
+
+    /* racing threads all arrive at the same answer */
+    if (avx2 < 0)
+        avx2 = __builtin_cpu_supports("avx2")
+            && __builtin_cpu_supports("popcnt");
+
+    return avx2;
+}
+
+#endif /* __SSE2__ */
+
+char const *proc_find(char const *buf, size_t len, char const *key) {
+    size_t kn = strlen(key);
+    char const *p = buf, *end = buf + len;
+
+    if (kn < 2)
+        return NULL;
+
+    /* a match counts only at the start of a line */
+    while (p < end) {
+#if defined __SSE2__
+        p = have_avx2() ? find_avx2(p, end - p, key, kn)
+                        : find_sse2(p, end - p, key, kn);
+#else
+        p = find_scalar(p, end - p, key, kn);
+#endif
+        if (!p)
+            return NULL;
+        if (p == buf || p[-1] == '\n')
+            return p + kn;
+        p++;
+    }
+
+    return NULL;
+}
+
+char const *proc_skip(char const *p, char const *end, int n) {
+    if (n <= 0)
+        return p;
+#if defined __SSE2__
+    return have_avx2() ? skip_avx2(p, end, n) : skip_sse2(p, end, n);
+#else
+    return skip_scalar(p, end, n);
+#endif
+}
+
+long long proc_num(char const *p, char const *end, char const **next) {
+    long long v = 0;
+    int neg = 0;
+
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    if (p < end && *p == '-') {
+        neg = 1;
+        p++;
+    }
+    if (p == end || *p < '0' || *p > '9') {
+        if (next)
+            *next = NULL;
+        return -1;
+    }
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+        v = v * 10 + (*p - '0');
+    if (next)
+        *next = p;
+
+    return neg ? -v : v;
+}
+
+long long proc_key_num(char const *buf, size_t len, char const *key) {
+    char const *p = proc_find(buf, len, key);
+
+    return p ? proc_num(p, buf + len, NULL) : -1;
+}
+
+int proc_stat_fields(char const *buf, size_t len, int const *fields,
+                     int num, long long *out) {
+    char const *end = buf + len;
+    char const *p;
+    int at = 3;                 /* field number p points at */
+
+    /* comm (field 2) may hold anything, so start after its last ')' */
+    p = memrchr(buf, ')', len);
+    if (!p || p + 2 > end)
+        return -1;
+    p += 2;
+
+    for (int i = 0; i < num; i++) {
+        if (fields[i] < at)
+            return -1;
+        p = proc_skip(p, end, fields[i] - at);
+        if (!p)
+            return -1;
+        at = fields[i];
+        out[i] = proc_num(p, end, NULL);
+    }
+
+    return 0;
+}
+
+/*
+ * Directory entries of /proc through getdents64() into the caller's
+ * struct, so walking fd and task lists needs no DIR (and no malloc).
+ */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+int proc_dir_open(struct proc_dir *d, char const *path) {
+    d->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    d->pos = d->len = 0;
+
+    return d->fd < 0 ? -1 : 0;
+}
+
+char const *proc_dir_next(struct proc_dir *d) {
+    for (;;) {
+        struct linux_dirent64 *de;
+
+        if (d->pos >= d->len) {
+            long n = syscall(SYS_getdents64, d->fd, d->buf, sizeof(d->buf));
+
+            if (n <= 0)
+                return NULL;
+            d->len = n;
+            d->pos = 0;
+        }
+        de = (struct linux_dirent64 *)(d->buf + d->pos);
+        d->pos += de->d_reclen;
+        if (de->d_name[0] != '.')
+            return de->d_name;
+    }
+}
+
+void proc_dir_close(struct proc_dir *d) {
+    if (d->fd >= 0)
+        close(d->fd);
+    d->fd = -1;
+}
@@ -0,0 +1,788 @@
+/*
+ * Copyright 2013
+ *  Steven Maresca <steve@zentific.com>
+ *  Zentific LLC
+ *
+ * proc_uring:
+ *  Batched /proc I/O for host-wide scans.
+ *
+ *  A scan of a large host is hundreds of thousands of tiny statx() and
+ *  open/read/close calls, each cheap for the kernel and dear in syscall
+ *  overhead. Here they are queued on an io_uring in batches: statx as is,
+ *  and each small file as an openat -> read -> close chain on a direct
+ *  descriptor slot, reading into one registered buffer. Where io_uring is
+ *  missing or disabled, lacks one of these operations or direct
+ *  descriptors (5.15), or on a single cpu where the kernel's workers for
+ *  these operations cannot run alongside us, the same calls are made one
+ *  by one instead.
+ *
+ *  Directory listings have no io_uring operation and stay synchronous.
+ *
+ *  The host prefilter built on it drops processes without masters before
+ *  anything else looks at them, and resolves those whose fdinfo carries
+ *  tty-index outright, provided all their threads share one fd table.
+ */
+
+#define _GNU_SOURCE             /* statx(), syscall() */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <linux/io_uring.h>
+#include <linux/kcmp.h>
+#include <linux/major.h>
+
+#include "ptmx_resolve.h"
+
+#define URING_DEPTH     256     /* sqes per ring, i.e. per submission */
+#define URING_READ_MAX  512     /* bytes read per file; fdinfo fits */
+#define SCAN_CHUNK      512     /* processes prefiltered per round */
+#define SCAN_PATH_MAX   48      /* "/proc/%ld/fdinfo/%d" */
+
+#define OP_STATX 0
+#define OP_OPEN  1
+#define OP_READ  2
+#define OP_CLOSE 3
+
+struct uring {
+    int fd;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned int pending;       /* queued, not yet published */
+    unsigned int unsubmitted;   /* published, not yet taken by the kernel */
+    unsigned int inflight;      /* published, not yet completed */
+    char *bufs;                 /* registered: one URING_READ_MAX per slot */
+    int num_slots;              /* direct descriptors, one chain each */
+};
+
+/* what a batch hands back per item: res is the byte count or -errno */
+typedef void (*batch_done)(void *ctx, int i, int res, void const *data);
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int submit, unsigned int wait) {
+    return syscall(__NR_io_uring_enter, fd, submit, wait,
+                   wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned int op, void *arg,
+                          unsigned int num) {
+    return syscall(__NR_io_uring_register, fd, op, arg, num);
+}
+
+static void uring_close(struct uring *u) {
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_len);
+    if (u->cq_ring && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_len);
+    if (u->sq_ring)
+        munmap(u->sq_ring, u->sq_len);
+    if (u->fd >= 0)
+        close(u->fd);
+    if (u->bufs)
+        munmap(u->bufs, (size_t)u->num_slots * URING_READ_MAX);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *u) {
+    unsigned int tail = *u->sq_tail + u->pending;
+    unsigned int idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+
+    u->sq_array[idx] = idx;
+    u->pending++;
+    memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+/* publish what was queued and wait for at least `wait` completions */
+static int uring_submit(struct uring *u, unsigned int wait) {
+    int n;
+
+    __atomic_store_n(u->sq_tail, *u->sq_tail + u->pending, __ATOMIC_RELEASE);
+    u->inflight += u->pending;
+    u->unsubmitted += u->pending;
+    u->pending = 0;
+
+    do {
+        n = uring_enter(u->fd, u->unsubmitted, wait);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        perror("io_uring_enter");
+        return -1;
+    }
+    u->unsubmitted -= n;
+
+    return 0;
+}
+
+/* every operation a batch issues, per IORING_REGISTER_PROBE (5.6+) */
+static int uring_has_ops(struct uring *u) {
+    static const int ops[] = { IORING_OP_STATX, IORING_OP_OPENAT,
+                               IORING_OP_READ_FIXED, IORING_OP_CLOSE };
+    struct io_uring_probe *probe;
+    size_t len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    int ret = 1;
+
+    probe = calloc(1, len);
+    if (!probe)
+        return 0;
+    if (uring_register(u->fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        free(probe);
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (ops[i] > probe->last_op
+            || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            debug("io_uring lacks opcode %d", ops[i]);
+            ret = 0;
+        }
+    }
+    free(probe);
+
+    return ret;
+}
+
+/*
+ * Kernels before 5.15 take an OPENAT with file_index as a plain open, and
+ * the linked CLOSE then closes sqe->fd, i.e. our stdin. One open into
+ * slot 0 tells: a direct open completes with 0, a plain one with an fd.
+ */
+static int uring_has_direct(struct uring *u) {
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    int res;
+
+    sqe = uring_sqe(u);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)"/proc/self/stat";
+    /* O_CLOEXEC is refused for direct opens; a plain fd is closed below */
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = 1;
+    if (uring_submit(u, 1) < 0 || *u->cq_head == *u->cq_tail)
+        return 0;
+
+    cqe = &u->cqes[*u->cq_head & *u->cq_mask];
+    res = cqe->res;
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+    u->inflight--;
+
+    if (res > 0) {
+        debug("io_uring has no direct descriptors");
+        close(res);
+        return 0;
+    }
+    if (res == 0) {
+        /* empty the slot again */
+        sqe = uring_sqe(u);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = 1;
+        if (uring_submit(u, 1) < 0)
+            return 0;
+        __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+        u->inflight--;
+    }
+
+    return res == 0;
+}
+
+/* -1 (quietly) when io_uring cannot be had; callers go synchronous */
+static int uring_open(struct uring *u) {
+    struct io_uring_params p;
+    struct iovec iov;
+    unsigned int workers[2];
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int *files;
+
+    /* statx and procfs opens are served by io-wq threads; with one cpu
+     * they cannot overlap and the handoffs only add to the cost */
+    if (ncpu < 2) {
+        debug("single cpu, using plain syscalls");
+        return -1;
+    }
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+
+    u->fd = uring_setup(URING_DEPTH, &p);
+    if (u->fd < 0 && errno == EINVAL) {
+        /* older kernels know neither hint */
+        memset(&p, 0, sizeof(p));
+        u->fd = uring_setup(URING_DEPTH, &p);
+    }
+    if (u->fd < 0) {
+        debug("io_uring unavailable (%s), using plain syscalls",
+              strerror(errno));
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+        goto fail;
+
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (u->cq_len > u->sq_len)
+        u->sq_len = u->cq_len;
+    u->sq_ring = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        goto fail;
+    }
+    u->cq_ring = u->sq_ring;
+
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto fail;
+    }
+
+    u->sq_head = (unsigned int *)((char *)u->sq_ring + p.sq_off.head);
+    u->sq_tail = (unsigned int *)((char *)u->sq_ring + p.sq_off.tail);
+    u->sq_mask = (unsigned int *)((char *)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned int *)((char *)u->sq_ring + p.sq_off.array);
+    u->cq_head = (unsigned int *)((char *)u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned int *)((char *)u->cq_ring + p.cq_off.tail);
+    u->cq_mask = (unsigned int *)((char *)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+
+    /* one direct descriptor and one buffer per open/read/close chain */
+    u->num_slots = p.sq_entries / 3;
+    files = malloc(u->num_slots * sizeof(*files));
+    if (!files)
+        goto fail;
+    memset(files, 0xff, u->num_slots * sizeof(*files));
+    if (uring_register(u->fd, IORING_REGISTER_FILES, files,
+                       u->num_slots) < 0) {
+        free(files);
+        goto fail;
+    }
+    free(files);
+
+    u->bufs = mmap(NULL, (size_t)u->num_slots * URING_READ_MAX,
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->bufs == MAP_FAILED) {
+        u->bufs = NULL;
+        goto fail;
+    }
+    iov.iov_base = u->bufs;
+    iov.iov_len = (size_t)u->num_slots * URING_READ_MAX;
+    if (uring_register(u->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+        goto fail;
+
+    if (!uring_has_ops(u) || !uring_has_direct(u)) {
+        errno = EOPNOTSUPP;
+        goto fail;
+    }
+
+    /* one worker per cpu is all the overlap there is to be had (5.15+) */
+    workers[0] = workers[1] = ncpu;
+    uring_register(u->fd, IORING_REGISTER_IOWQ_MAX_WORKERS, workers, 2);
+
+    return 0;
+
+fail:
+    debug("io_uring setup incomplete (%s), using plain syscalls",
+          strerror(errno));
+    uring_close(u);
+
+    return -1;
+}
+
+/* hand every completion to fn; returns how many were reaped */
+static unsigned int uring_reap(struct uring *u,
+                               void (*fn)(void *, struct io_uring_cqe *),
+                               void *ctx) {
+    unsigned int head = *u->cq_head;
+    unsigned int tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    unsigned int n = 0;
+
+    for (; head != tail; head++, n++)
+        fn(ctx, &u->cqes[head & *u->cq_mask]);
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    u->inflight -= n;
+
+    return n;
+}
+
+struct batch_ctx {
+    struct uring *u;
+    char const *const *paths;
+    struct statx *stx;
+    batch_done done;
+    void *ctx;
+    int *slot_item;             /* chain slot -> item index */
+    int *free_slots;
+    int num_free;
+};
+
+static void statx_cqe(void *arg, struct io_uring_cqe *cqe) {
+    struct batch_ctx *b = arg;
+    int i = cqe->user_data >> 2;
+
+    b->done(b->ctx, i, cqe->res, &b->stx[i]);
+}
+
+/*
+ * statx() every path into stx[i]; done() gets res 0 or -errno per path.
+ * Falls back to plain statx() when u is NULL.
+ */
+static int batch_statx(struct uring *u, char const *const *paths, int num,
+                       struct statx *stx, batch_done done, void *ctx) {
+    struct batch_ctx b = { .u = u, .paths = paths, .stx = stx, .done = done,
+                           .ctx = ctx };
+    int i = 0;
+
+    if (!u) {
+        for (i = 0; i < num; i++) {
+            int res = statx(AT_FDCWD, paths[i], 0, STATX_TYPE | STATX_INO
+                            | STATX_NLINK, &stx[i]) < 0 ? -errno : 0;
+            done(ctx, i, res, &stx[i]);
+        }
+        return 0;
+    }
+
+    while (i < num || u->inflight) {
+        while (i < num && u->inflight + u->pending < URING_DEPTH) {
+            struct io_uring_sqe *sqe = uring_sqe(u);
+
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t)paths[i];
+            sqe->len = STATX_TYPE | STATX_INO | STATX_NLINK;
+            sqe->off = (uintptr_t)&stx[i];
+            sqe->user_data = (uint64_t)i << 2 | OP_STATX;
+            i++;
+        }
+        if (uring_submit(u, 1) < 0)
+            return -1;
+        uring_reap(u, statx_cqe, &b);
+    }
+
+    return 0;
+}
+
+static void read_cqe(void *arg, struct io_uring_cqe *cqe) {
+    struct batch_ctx *b = arg;
+    int slot = cqe->user_data >> 2;
+    int i = b->slot_item[slot];
+
+    switch (cqe->user_data & 3) {
+    case OP_OPEN:
+        /* success is silent: the read reports for the chain; direct
+         * descriptors were checked for in uring_open() */
+        if (cqe->res < 0)
+            b->done(b->ctx, i, cqe->res, NULL);
+        break;
+    case OP_READ:
+        if (cqe->res >= 0)
+            b->u->bufs[(size_t)slot * URING_READ_MAX + cqe->res] = '\0';
+        if (cqe->res != -ECANCELED)
+            b->done(b->ctx, i, cqe->res,
+                    b->u->bufs + (size_t)slot * URING_READ_MAX);
+        break;
+    case OP_CLOSE:
+        /* last link: the slot and its buffer are free again */
+        b->free_slots[b->num_free++] = slot;
+        break;
+    }
+}
+
+/*
+ * Read up to URING_READ_MAX - 1 bytes of every path; done() gets the byte
+ * count (data NUL terminated) or -errno. Falls back to open/read/close.
+ */
+static int batch_read(struct uring *u, char const *const *paths, int num,
+                      batch_done done, void *ctx) {
+    struct batch_ctx b = { .u = u, .paths = paths, .done = done, .ctx = ctx };
+    char buf[URING_READ_MAX];
+    int i = 0, ret = 0;
+
+    if (!u) {
+        for (i = 0; i < num; i++) {
+            int fd = open(paths[i], O_RDONLY | O_CLOEXEC);
+            ssize_t n;
+
+            if (fd < 0) {
+                done(ctx, i, -errno, NULL);
+                continue;
+            }
+            n = read(fd, buf, sizeof(buf) - 1);
+            if (n < 0)
+                n = -errno;
+            close(fd);
+            if (n >= 0)
+                buf[n] = '\0';
+            done(ctx, i, n, buf);
+        }
+        return 0;
+    }
+
+    b.slot_item = malloc(2 * u->num_slots * sizeof(int));
+    if (!b.slot_item)
+        return -1;
+    b.free_slots = b.slot_item + u->num_slots;
+    for (int s = 0; s < u->num_slots; s++)
+        b.free_slots[b.num_free++] = s;
+
+    while (i < num || u->inflight) {
+        while (i < num && b.num_free) {
+            int slot = b.free_slots[--b.num_free];
+            struct io_uring_sqe *sqe;
+
+            b.slot_item[slot] = i;
+
+            /* open straight into direct slot `slot`; no fd table entry */
+            sqe = uring_sqe(u);
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t)paths[i];
+            /* direct descriptors never reach the fd table: no O_CLOEXEC */
+            sqe->open_flags = O_RDONLY;
+            sqe->file_index = slot + 1;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->user_data = (uint64_t)slot << 2 | OP_OPEN;
+
+            /* leaves room for the terminating NUL the sync path adds */
+            sqe = uring_sqe(u);
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->fd = slot;
+            sqe->addr = (uintptr_t)(u->bufs + (size_t)slot * URING_READ_MAX);
+            sqe->len = URING_READ_MAX - 1;
+            sqe->buf_index = 0;
+            sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+            sqe->user_data = (uint64_t)slot << 2 | OP_READ;
+
+            /* hard link: runs even when the read failed */
+            sqe = uring_sqe(u);
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->file_index = slot + 1;
+            sqe->user_data = (uint64_t)slot << 2 | OP_CLOSE;
+            i++;
+        }
+        if (uring_submit(u, 1) < 0) {
+            ret = -1;
+            break;
+        }
+        uring_reap(u, read_cqe, &b);
+    }
+    free(b.slot_item);
+
+    return ret;
+}
+
+/* prefilter state for one chunk of processes */
+struct scan_pid {
+    long pid;
+    int threads;
+    int first_fd, num_fds;      /* range in scan.fds */
+    int masters, answered;
+};
+
+struct scan {
+    struct scan_pid *pids;
+    int num_pids;
+    int *fds, *fd_owner, *fd_pts, num_fds, max_fds;
+    char (*paths)[SCAN_PATH_MAX];
+    char const **path_ptrs;
+    int *items;                 /* path index -> fd index, for fdinfo */
+    int max_paths;
+    struct ptsname_entry *out;
+    int num_out, max_out;
+};
+
+static void scan_task_done(void *ctx, int i, int res, void const *data) {
+    struct scan *s = ctx;
+    struct statx const *stx = data;
+
+    /* /proc/$PID/task links once per thread, plus . and .. */
+    s->pids[i].threads = res == 0 ? (int)stx->stx_nlink - 2 : 0;
+}
+
+static void scan_fd_done(void *ctx, int i, int res, void const *data) {
+    struct scan *s = ctx;
+    struct statx const *stx = data;
+    int f = i;
+
+    if (res == 0 && S_ISCHR(stx->stx_mode)
+        && stx->stx_rdev_major == TTYAUX_MAJOR && stx->stx_rdev_minor == 2) {
+        s->fd_pts[f] = -1;
+        s->pids[s->fd_owner[f]].masters++;
+    } else {
+        s->fd_pts[f] = -2;      /* not a master */
+    }
+}
+
+static void scan_fdinfo_done(void *ctx, int i, int res, void const *data) {
+    struct scan *s = ctx;
+    int f = s->items[i];
+    long long pts;
+
+    if (res <= 0 || !data)
+        return;
+    pts = proc_key_num(data, res, "tty-index:");
+    if (pts < 0)
+        return;
+    s->fd_pts[f] = pts;
+    s->pids[s->fd_owner[f]].answered++;
+}
+
+static int scan_add_fd(struct scan *s, int owner, int fd) {
+    if (s->num_fds == s->max_fds) {
+        int max = s->max_fds ? 2 * s->max_fds : 4096;
+        void *tmp;
+
+        tmp = realloc(s->fds, 3 * max * sizeof(int));
+        if (!tmp)
+            return -1;
+        /* fds | fd_owner | fd_pts share one allocation */
+        s->fds = tmp;
+        memmove(s->fds + 2 * max, s->fds + 2 * s->max_fds,
+                s->num_fds * sizeof(int));
+        memmove(s->fds + max, s->fds + s->max_fds, s->num_fds * sizeof(int));
+        s->fd_owner = s->fds + max;
+        s->fd_pts = s->fds + 2 * max;
+        s->max_fds = max;
+    }
+    s->fds[s->num_fds] = fd;
+    s->fd_owner[s->num_fds] = owner;
+    s->num_fds++;
+
+    return 0;
+}
+
+static int scan_grow_paths(struct scan *s, int num) {
+    void *tmp;
+
+    if (num <= s->max_paths)
+        return 0;
+    tmp = realloc(s->paths, num * sizeof(*s->paths));
+    if (!tmp)
+        return -1;
+    s->paths = tmp;
+    tmp = realloc(s->path_ptrs, num * sizeof(*s->path_ptrs));
+    if (!tmp)
+        return -1;
+    s->path_ptrs = tmp;
+    tmp = realloc(s->items, num * sizeof(*s->items));
+    if (!tmp)
+        return -1;
+    s->items = tmp;
+    s->max_paths = num;
+
+    return 0;
+}
+
+static int scan_emit(struct scan *s, long pid, int fd, int pts) {
+    if (s->num_out == s->max_out) {
+        int max = s->max_out ? 2 * s->max_out : 256;
+        struct ptsname_entry *tmp = realloc(s->out, max * sizeof(*tmp));
+
+        if (!tmp)
+            return -1;
+        s->out = tmp;
+        s->max_out = max;
+    }
+    s->out[s->num_out].pid = s->out[s->num_out].tid = pid;
+    s->out[s->num_out].fd = fd;
+    s->out[s->num_out].pts = pts;
+    s->num_out++;
+
+    return 0;
+}
+
+/*
+ * Whether every thread of pid uses the leader's fd table, as threads
+ * normally do: then the leader's fds are all there is. kcmp(KCMP_FILES),
+ * one per thread, and only for processes that could be answered here.
+ */
+static int one_fd_table(long pid) {
+    struct dirent *de;
+    char dir[64];
+    int ret = 1;
+    DIR *d;
+
+    snprintf(dir, sizeof(dir), "/proc/%ld/task", pid);
+    d = opendir(dir);
+    if (!d)
+        return 0;
+    while (ret && (de = readdir(d))) {
+        long tid = atol(de->d_name);
+
+        if (tid <= 0 || tid == pid)
+            continue;
+        if (syscall(SYS_kcmp, pid, tid, KCMP_FILES, 0, 0) != 0)
+            ret = 0;
+    }
+    closedir(d);
+
+    return ret;
+}
+
+/* one chunk: list fds, statx them, read the masters' fdinfo */
+static int scan_chunk(struct uring *u, struct scan *s, long const *pids,
+                      int num_pids, long *keep, int *num_keep) {
+    struct statx *stx = NULL;
+    int num_paths, n;
+    int ret = -1;
+
+    s->num_pids = num_pids;
+    s->num_fds = 0;
+
+    for (int p = 0; p < num_pids; p++) {
+        struct scan_pid *sp = &s->pids[p];
+        struct dirent *de;
+        char dir[64];
+        DIR *d;
+
+        memset(sp, 0, sizeof(*sp));
+        sp->pid = pids[p];
+        sp->first_fd = s->num_fds;
+
+        snprintf(dir, sizeof(dir), "/proc/%ld/fd", sp->pid);
+        d = opendir(dir);
+        if (!d)
+            continue;
+        while ((de = readdir(d))) {
+            if (de->d_name[0] == '.')
+                continue;
+            if (scan_add_fd(s, p, atoi(de->d_name)) < 0) {
+                closedir(d);
+                return -1;
+            }
+        }
+        closedir(d);
+        sp->num_fds = s->num_fds - sp->first_fd;
+    }
+
+    /* task dirs first, then every fd */
+    num_paths = num_pids + s->num_fds;
+    if (scan_grow_paths(s, num_paths) < 0)
+        return -1;
+    stx = malloc(num_paths * sizeof(*stx));
+    if (!stx)
+        return -1;
+    for (int p = 0; p < num_pids; p++) {
+        snprintf(s->paths[p], SCAN_PATH_MAX, "/proc/%ld/task", pids[p]);
+        s->path_ptrs[p] = s->paths[p];
+    }
+    for (int f = 0; f < s->num_fds; f++) {
+        snprintf(s->paths[num_pids + f], SCAN_PATH_MAX, "/proc/%ld/fd/%d",
+                 s->pids[s->fd_owner[f]].pid, s->fds[f]);
+        s->path_ptrs[num_pids + f] = s->paths[num_pids + f];
+    }
+
+    for (int p = 0; p < num_pids; p++)
+        s->pids[p].threads = 0;
+    if (batch_statx(u, s->path_ptrs, num_pids, stx, scan_task_done, s) < 0
+        || batch_statx(u, s->path_ptrs + num_pids, s->num_fds,
+                       stx + num_pids, scan_fd_done, s) < 0)
+        goto wrap_up;
+
+    /* the kernel's own answers, from the masters' fdinfo */
+    n = 0;
+    for (int f = 0; f < s->num_fds; f++) {
+        if (s->fd_pts[f] != -1)
+            continue;
+        snprintf(s->paths[n], SCAN_PATH_MAX, "/proc/%ld/fdinfo/%d",
+                 s->pids[s->fd_owner[f]].pid, s->fds[f]);
+        s->path_ptrs[n] = s->paths[n];
+        s->items[n++] = f;
+    }
+    if (n && batch_read(u, s->path_ptrs, n, scan_fdinfo_done, s) < 0)
+        goto wrap_up;
+
+    for (int p = 0; p < num_pids; p++) {
+        struct scan_pid *sp = &s->pids[p];
+
+        /* threads may keep tables of their own: leave those to the full
+         * scan, as well as any master fdinfo had no answer for */
+        if (sp->answered < sp->masters
+            || (sp->threads > 1 && !one_fd_table(sp->pid))) {
+            keep[(*num_keep)++] = sp->pid;
+            continue;
+        }
+        for (int f = sp->first_fd; f < sp->first_fd + sp->num_fds; f++) {
+            if (s->fd_pts[f] >= 0 && scan_emit(s, sp->pid, s->fds[f],
+                                               s->fd_pts[f]) < 0)
+                goto wrap_up;
+        }
+    }
+    ret = 0;
+
+wrap_up:
+    free(stx);
+
+    return ret;
+}
+
+int ptsname_host_prefilter(long *pids, int *num_pids,
+                           struct ptsname_entry **entries, int *num_entries) {
+    struct scan s;
+    struct uring ring;
+    struct uring *u = NULL;
+    int num_keep = 0;
+    int ret = -1;
+
+    memset(&s, 0, sizeof(s));
+    *entries = NULL;
+    *num_entries = 0;
+
+    if (uring_open(&ring) == 0)
+        u = &ring;
+
+    s.pids = calloc(SCAN_CHUNK, sizeof(*s.pids));
+    if (!s.pids)
+        goto wrap_up;
+
+    /* kept pids are compacted in place, never overtaking the cursor */
+    for (int i = 0; i < *num_pids; i += SCAN_CHUNK) {
+        int n = *num_pids - i < SCAN_CHUNK ? *num_pids - i : SCAN_CHUNK;
+
+        if (scan_chunk(u, &s, pids + i, n, pids, &num_keep) < 0)
+            goto wrap_up;
+    }
+
+    debug("prefilter: %d of %d processes left, %d fds resolved from fdinfo "
+          "(%s)", num_keep, *num_pids, s.num_out, u ? "io_uring" : "sync");
+
+    *num_pids = num_keep;
+    *entries = s.out;
+    *num_entries = s.num_out;
+    s.out = NULL;
+    ret = 0;
+
+wrap_up:
+    if (u)
+        uring_close(u);
+    free(s.pids);
+    free(s.fds);
+    free(s.paths);
+    free(s.path_ptrs);
+    free(s.items);
+    free(s.out);
+
+    return ret;
+}
@@ -11,6 +11,8 @@
  *
  */
 
+#define _GNU_SOURCE             /* strptime() */
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -21,11 +23,431 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <time.h>
 
 #include <errno.h>
+#include <linux/major.h>
 #include "ptmx_resolve.h"
 
+static void usage(void) {
+    printf("Usage: ptmx_resolve $PID [<optional> target file descriptor ID]\n"
+           "       ptmx_resolve --connect $PID $FD [<optional> unix socket path]\n"
+           "       ptmx_resolve --serve $PID $DIR [<optional> scrollback bytes]\n"
+           "       ptmx_resolve --tree $PID\n"
+           "       ptmx_resolve --cgroup /sys/fs/cgroup/$GROUP\n"
+           "       ptmx_resolve --agent-install $PID | --agent-remove $PID\n"
+           "       ptmx_resolve --fuse [<optional> mount point, /run/ptmx]\n"
+           "       ptmx_resolve --probe $PID\n"
+           "       ptmx_resolve --host [<optional> max stopped [stop usec per target [window usec]]]\n"
+           "       ptmx_resolve --record $DIR [<optional> interval seconds]\n"
+           "       ptmx_resolve --who $DIR $PTS $TIME (unix seconds or \"YYYY-mm-dd HH:MM:SS\")\n");
+}
+
+/* --agent-install PID / --agent-remove PID */
+static int agent_main(int argc, char **argv) {
+    long pid;
+    int ret;
+
+    if (argc < 3)
+        goto err;
+
+    pid = strtol(argv[2], NULL, 10);
+    if (errno) goto err;
+
+    if (!strcmp(argv[1], "--agent-install"))
+        ret = ptmx_agent_install(pid);
+    else
+        ret = ptmx_agent_remove(pid);
+
+    printf("target_pid=%ld agent=%s\n", pid,
+           ret < 0 ? "error" :
+           !strcmp(argv[1], "--agent-install") ? "installed" : "removed");
+
+    return ret < 0 ? 1 : 0;
+
+err:
+    usage();
+    exit(1);
+}
+
+/* --record DIR [INTERVAL]: log allocations until interrupted */
+static int record_main(int argc, char **argv) {
+    struct ptsname_budget cfg = { 4, 10000, 1000000 };
+    double interval = 1.0;
+
+    if (argc < 3)
+        goto err;
+    if (argc > 3)
+        interval = strtod(argv[3], NULL);
+    if (errno || interval <= 0)
+        goto err;
+
+    return ptmx_record(argv[2], interval * 1000000, &cfg) < 0 ? 1 : 0;
+
+err:
+    usage();
+    exit(1);
+}
+
+/*
+ * --who DIR PTS TIME: who held PTS at TIME, per the recording. PTS is a
+ * number on the host's /dev/pts, or the path of a node on any instance.
+ */
+static int who_main(int argc, char **argv) {
+    struct pts_record *owners = NULL;
+    int num_owners = 0;
+    struct stat st;
+    struct tm tm;
+    char when_str[64];
+    uint64_t when;
+    time_t secs;
+    char *end;
+    int pts;
+
+    if (argc < 5)
+        goto err;
+
+    if (argv[3][0] == '/') {
+        if (stat(argv[3], &st) < 0) {
+            perror(argv[3]);
+            return 1;
+        }
+        if (!S_ISCHR(st.st_mode) || major(st.st_rdev) < UNIX98_PTY_SLAVE_MAJOR
+            || major(st.st_rdev) >= UNIX98_PTY_SLAVE_MAJOR
+                                    + UNIX98_PTY_MAJOR_COUNT) {
+            fprintf(stderr, "%s is not a pty slave\n", argv[3]);
+            return 1;
+        }
+        pts = (major(st.st_rdev) - UNIX98_PTY_SLAVE_MAJOR) * 256
+            + minor(st.st_rdev);
+    } else {
+        pts = strtol(argv[3], &end, 10);
+        if (*end || end == argv[3])
+            goto err;
+        if (stat("/dev/pts", &st) < 0) {
+            perror("/dev/pts");
+            return 1;
+        }
+    }
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_isdst = -1;
+    end = strptime(argv[4], "%Y-%m-%d %H:%M:%S", &tm);
+    if (!end)
+        end = strptime(argv[4], "%Y-%m-%dT%H:%M:%S", &tm);
+    if (end && !*end) {
+        when = (uint64_t)mktime(&tm) * 1000000;
+    } else {
+        double t = strtod(argv[4], &end);
+        if (*end || t < 0)
+            goto err;
+        when = t * 1000000;
+    }
+
+    if (ptsname_timeline_who(argv[2], st.st_dev, pts, when, &owners,
+                             &num_owners) < 0)
+        return 1;
+
+    secs = when / 1000000;
+    strftime(when_str, sizeof(when_str), "%Y-%m-%d %H:%M:%S",
+             localtime(&secs));
+    printf("There were %d holders of pts %d at %s\n", num_owners, pts,
+           when_str);
+    for (int i = 0; i < num_owners; i++) {
+        secs = owners[i].ts / 1000000;
+        strftime(when_str, sizeof(when_str), "%Y-%m-%d %H:%M:%S",
+                 localtime(&secs));
+        printf("target_pid=%d target_fd=%d start_time=%llu exe_hash=%016llx"
+               " %s=%s\n", owners[i].pid, owners[i].fd,
+               (unsigned long long)owners[i].start_time,
+               (unsigned long long)owners[i].exe_hash,
+               owners[i].event == PTS_HELD ? "held_at" : "since", when_str);
+    }
+    free(owners);
+
+    return 0;
+
+err:
+    usage();
+    exit(1);
+}
+
+/* --probe PID: what the program itself says, no ptrace involved */
+static int probe_main(int argc, char **argv) {
+    struct ptsname_probe_pty ptys[64];
+    char const *name = NULL;
+    long pid;
+    int num;
+
+    if (argc < 3)
+        goto err;
+
+    pid = strtol(argv[2], NULL, 10);
+    if (errno) goto err;
+
+    num = ptsname_probe(pid, ptys, 64, &name);
+    if (num < 0) {
+        fprintf(stderr, "no probe answered for pid %ld\n", pid);
+        return 1;
+    }
+
+    for (int i = 0; i < num; i++)
+        printf("target_pid=%ld probe=%s label=%s pts=/dev/pts/%d\n", pid,
+               name, ptys[i].label, ptys[i].pts);
+
+    return 0;
+
+err:
+    usage();
+    exit(1);
+}
+
+/* --fuse [MOUNTPOINT] */
+static int fuse_main(int argc, char **argv) {
+    return ptmx_fuse(argc > 2 ? argv[2] : "/run/ptmx") < 0 ? 1 : 0;
+}
+
+/* namespace-aware paths for entries; NULL (after a complaint) on failure */
+static struct ptsname_path *entry_paths(struct ptsname_entry const *entries,
+                                        int num_entries) {
+    struct ptsname_path *paths;
+
+    paths = calloc(num_entries ? num_entries : 1, sizeof(*paths));
+    if (!paths) {
+        perror("calloc");
+        return NULL;
+    }
+    ptsname_paths(entries, num_entries, paths);
+
+    return paths;
+}
+
+/* pts= is the path inside the target's namespace; host_pts= is added
+ * whenever that differs from where we can reach it */
+static void print_entries(struct ptsname_entry const *entries,
+                          int num_entries, int with_fd) {
+    struct ptsname_path *paths = entry_paths(entries, num_entries);
+
+    if (!paths)
+        return;
+
+    for (int i = 0; i < num_entries; i++) {
+        printf("target_pid=%ld ", entries[i].pid);
+        if (with_fd)
+            printf("target_fd=%d ", entries[i].fd);
+        printf("pts=%s", paths[i].ns);
+        if (strcmp(paths[i].ns, paths[i].host))
+            printf(" host_pts=%s", paths[i].host);
+        printf("\n");
+    }
+    free(paths);
+}
+
+/* --host [K [T [W]]]: every process, K stopped at most, T usec of stop
+ * per target every W usec */
+static int host_main(int argc, char **argv) {
+    struct ptsname_budget cfg = { 4, 10000, 1000000 };
+    struct ptsname_entry *entries = NULL;
+    int num_entries = 0;
+    int ret;
+
+    if (argc > 2)
+        cfg.max_stopped = strtol(argv[2], NULL, 10);
+    if (argc > 3)
+        cfg.budget_usec = strtol(argv[3], NULL, 10);
+    if (argc > 4)
+        cfg.window_usec = strtol(argv[4], NULL, 10);
+    if (errno || cfg.max_stopped <= 0 || cfg.budget_usec < 0
+        || cfg.window_usec <= 0)
+        goto err;
+
+    ret = ptsname_list_host(&cfg, &entries, &num_entries);
+
+    printf("There were %d /dev/pts devices discovered on this host\n",
+           num_entries);
+    print_entries(entries, num_entries, 1);
+    free(entries);
+
+    return ret < 0 ? 1 : 0;
+
+err:
+    usage();
+    exit(1);
+}
+
+/* --tree PID: every pty of PID and all of its descendants */
+static int tree_main(int argc, char **argv) {
+    struct ptsname_entry *entries = NULL;
+    int num_entries = 0;
+    long pid;
+    int ret;
+
+    if (argc < 3)
+        goto err;
+
+    pid = strtol(argv[2], NULL, 10);
+    if (errno) goto err;
+
+    ret = ptsname_list_tree(pid, &entries, &num_entries);
+
+    printf("There were %d /dev/pts devices discovered for the tree of pid=%ld\n",
+           num_entries, pid);
+    print_entries(entries, num_entries, 1);
+    free(entries);
+
+    return ret;
+
+err:
+    usage();
+    exit(1);
+}
+
+/* --cgroup DIR: every pty of every process in a cgroup */
+static int cgroup_main(int argc, char **argv) {
+    struct ptsname_entry *entries = NULL;
+    int num_entries = 0;
+    int ret;
+
+    if (argc < 3)
+        goto err;
+
+    ret = ptsname_list_cgroup(argv[2], &entries, &num_entries);
+
+    printf("There were %d /dev/pts devices discovered for cgroup %s\n",
+           num_entries, argv[2]);
+    print_entries(entries, num_entries, 1);
+    free(entries);
+
+    return ret;
+
+err:
+    usage();
+    exit(1);
+}
+
+/* --connect PID FD [SOCKET]: resolve, then relay the slave ourselves */
+static int connect_main(int argc, char **argv) {
+    struct ptsname_entry entry;
+    struct ptsname_path *path;
+    long pid;
+    int target_fd;
+    int pts_id = -1;
+    int ret;
+
+    if (argc < 4)
+        goto err;
+
+    pid = strtol(argv[2], NULL, 10);
+    target_fd = strtol(argv[3], NULL, 10);
+    if (errno) goto err;
+
+    if (ptsname_by_fd(pid, target_fd, &pts_id) < 0 || pts_id < 0) {
+        fprintf(stderr, "cannot resolve fd %d of pid %ld\n", target_fd, pid);
+        return 1;
+    }
+
+    entry.pid = pid;
+    entry.tid = pid;
+    entry.fd = target_fd;
+    entry.pts = pts_id;
+    path = entry_paths(&entry, 1);
+    if (!path)
+        return 1;
+
+    fprintf(stderr, "target_pid=%ld target_fd=%d pts=%s host_pts=%s\n",
+            pid, target_fd, path->ns, path->host);
+
+    ret = ptmx_relay(path->host, argc > 4 ? argv[4] : NULL);
+    free(path);
+
+    return ret < 0 ? 1 : 0;
+
+err:
+    usage();
+    exit(1);
+}
+
+/* --serve PID DIR [SCROLLBACK]: fan every pty of PID out to DIR sockets */
+static int serve_main(int argc, char **argv) {
+    struct ptsname_entry *entries = NULL;
+    struct ptsname_path *paths;
+    char const **path_ptrs;
+    size_t scrollback = 1 << 20;
+    int num_entries = 0;
+    int num_paths = 0;
+    long pid;
+    int ret;
+
+    if (argc < 4)
+        goto err;
+
+    pid = strtol(argv[2], NULL, 10);
+    if (argc > 4)
+        scrollback = strtoul(argv[4], NULL, 10);
+    if (errno) goto err;
+
+    if (ptsname_list_pids(&pid, 1, &entries, &num_entries) < 0
+        && num_entries == 0) {
+        fprintf(stderr, "cannot resolve ptys of pid %ld\n", pid);
+        free(entries);
+        return 1;
+    }
+
+    paths = entry_paths(entries, num_entries);
+    path_ptrs = calloc(num_entries ? num_entries : 1, sizeof(*path_ptrs));
+    if (!paths || !path_ptrs) {
+        free(paths);
+        free(entries);
+        return 1;
+    }
+
+    /* several fds (dup) may name one pty; serve each pty once */
+    for (int i = 0; i < num_entries; i++) {
+        int j;
+        for (j = 0; j < num_paths; j++) {
+            if (!strcmp(path_ptrs[j], paths[i].host))
+                break;
+        }
+        if (j == num_paths)
+            path_ptrs[num_paths++] = paths[i].host;
+    }
+
+    ret = ptmx_serve(path_ptrs, num_paths, argv[3], scrollback);
+
+    free(path_ptrs);
+    free(paths);
+    free(entries);
+
+    return ret < 0 ? 1 : 0;
+
+err:
+    usage();
+    exit(1);
+}
+
+/* whatever this run had to resolve, the next one does not */
+static void cache_save(void) {
+    ptsname_cache_save(PTSNAME_CACHE_FILE);
+}
+
+/* the modes that resolve masters; the rest have nothing to learn or keep */
+static int cache_wanted(char const *mode) {
+    static char const *const modes[] = {
+        "--tree", "--cgroup", "--host", "--fuse", "--record",
+    };
+
+    if (strncmp(mode, "--", 2))
+        return 1;
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        if (!strcmp(mode, modes[i]))
+            return 1;
+    }
+
+    return 0;
+}
+
 int main(int argc, char **argv) {
     long pid = -1;
     int pts_id = -1;
@@ -35,37 +457,69 @@ int main(int argc, char **argv) {
         goto err;
     }
 
+    if (cache_wanted(argv[1])) {
+        ptsname_cache_load(PTSNAME_CACHE_FILE);
+        atexit(cache_save);
+        errno = 0;              /* argument parsing below checks it */
+    }
+
+    if (!strcmp(argv[1], "--connect"))
+        return connect_main(argc, argv);
+    if (!strcmp(argv[1], "--serve"))
+        return serve_main(argc, argv);
+    if (!strcmp(argv[1], "--tree"))
+        return tree_main(argc, argv);
+    if (!strcmp(argv[1], "--cgroup"))
+        return cgroup_main(argc, argv);
+    if (!strcmp(argv[1], "--agent-install")
+        || !strcmp(argv[1], "--agent-remove"))
+        return agent_main(argc, argv);
+    if (!strcmp(argv[1], "--host"))
+        return host_main(argc, argv);
+    if (!strcmp(argv[1], "--record"))
+        return record_main(argc, argv);
+    if (!strcmp(argv[1], "--who"))
+        return who_main(argc, argv);
+    if (!strcmp(argv[1], "--fuse"))
+        return fuse_main(argc, argv);
+    if (!strcmp(argv[1], "--probe"))
+        return probe_main(argc, argv);
+
     pid = strtol(argv[1], NULL, 10);
 
     if(errno) goto err;
 
     if (argv[2]) {
+        struct ptsname_entry entry;
+
         target_fd = strtol(argv[2], NULL, 10);
         
         if(errno) goto err;
 
         int ret = ptsname_by_fd(pid, target_fd, &pts_id);
 
-        printf("target_pid=%ld target_fd=%d pts=/dev/pts/%d\n",
-                pid, target_fd, pts_id);
+        entry.pid = pid;
+        entry.tid = pid;
+        entry.fd = target_fd;
+        entry.pts = pts_id;
+        print_entries(&entry, 1, 1);
         
         return ret;
     }
 
     /* catchall case: list all /dev/pts paths discovered */
-    int num_ids = 0;
-    int *ids_array = NULL;
-    int ret = ptsname_list_all(pid, &ids_array, &num_ids);
+    int num_entries = 0;
+    struct ptsname_entry *entries = NULL;
+    int ret = ptsname_list_pids(&pid, 1, &entries, &num_entries);
 
-    printf("There were %d /dev/pts devices discovered for pid=%ld\n", num_ids, pid);
-    for(;num_ids > 0; num_ids--){
-        printf("target_pid=%ld pts=/dev/pts/%d\n", pid, ids_array[num_ids-1]);
-    }
-    free(ids_array);
+    printf("There were %d /dev/pts devices discovered for pid=%ld\n",
+           num_entries, pid);
+    print_entries(entries, num_entries, 0);
+    free(entries);
 
     return ret;
 
 err:
-    printf("Usage: ptmx_resolve $PID [<optional> target file descriptor ID]\n");
+    usage();
     exit(1);
 }
@@ -1,3 +1,8 @@
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
 #if defined DEBUG
 #   include <stdio.h>
 #   include <stdarg.h>
@@ -14,5 +19,209 @@ static inline void debug(const char *format, ...)
 #   define debug(format, ...) do {} while(0)
 #endif
 
+struct ptsname_entry {
+    long pid;
+    long tid;           /* owner of the fd table fd belongs to */
+    int fd;
+    int pts;
+};
+
+/* Caller-owned scratch for the allocation-free calls: they take what they
+ * need from base + used and give it all back before returning */
+struct ptsname_arena {
+    void *base;
+    size_t size;
+    size_t used;
+};
+
 int ptsname_list_all(long pid, int **pts_ids, int *num_ids);
+/* pid's ptys into out[max_out], with no program probes: how many were
+ * written (0 if it holds no master), -1 if its fds cannot be read or
+ * resolved, or with ENOMEM if arena or out was too small for all that was
+ * found (nothing partial is returned). No heap use: the fdinfo reads,
+ * cache, agent, fd copy and ptrace fallback it reaches allocate nothing,
+ * and their messages go to unbuffered stderr. */
+int ptsname_list_into(long pid, struct ptsname_entry *out, int max_out,
+                      struct ptsname_arena *arena);
 int ptsname_by_fd(long pid, int target_fd, int *pts_id);
+/* the kernel's own answer from fdinfo, where it gives one */
+int ptsname_fdinfo(long pid, long tid, int fd, int *pts_id);
+/* process start time in clock ticks since boot; (pid, start) is unique */
+int ptsname_start_time(long pid, unsigned long long *start_time);
+
+/* Resolve several processes in one pass: fds sharing an open file
+ * description (fork, dup, SCM_RIGHTS) are resolved once for all of them */
+int ptsname_list_pids(long const *pids, int num_pids,
+                      struct ptsname_entry **entries, int *num_entries);
+/* the same, with the fd tables that still need a stop after every stop-free
+ * method handed to num_workers threads, most latency sensitive first */
+int ptsname_list_pids_pooled(long const *pids, int num_pids, int num_workers,
+                             struct ptsname_entry **entries,
+                             int *num_entries);
+int ptsname_list_tree(long pid, struct ptsname_entry **entries,
+                      int *num_entries);
+
+/* pts_cache.c: answers remembered per generation of pid:fd, so a repeated
+ * question needs no attach; an answer is only given back while the slave
+ * it names is still the node it was. Load/save carry them across runs. */
+#define PTSNAME_CACHE_FILE "/run/ptmx_resolve.cache"
+
+struct ptsname_gen {
+    unsigned long long start_time;  /* of the process */
+    dev_t dev;                      /* the master's inode */
+    ino_t ino;
+    int mnt_id;                     /* the master's, from fdinfo */
+    struct timespec asked;          /* CLOCK_REALTIME_COARSE, before
+                                     * resolving: see ptsname_gen_now() */
+};
+
+void ptsname_gen_now(struct ptsname_gen *gen);
+
+int ptsname_cache_get(long pid, int fd, struct ptsname_gen const *gen,
+                      int *pts_id);
+void ptsname_cache_put(long pid, int fd, struct ptsname_gen const *gen,
+                       int pts_id);
+int ptsname_cache_load(char const *path);
+int ptsname_cache_save(char const *path);
+
+/* app_probe.c: ask QEMU (QMP), tmux or screen which ptys they hold. An
+ * answer names ptys, not fds; returns how many, -1 if no probe applies or
+ * it failed. The per-protocol calls take pid 0 for a path as seen here;
+ * only then may the tmux client be other than the system's (NULL), so a
+ * stand-in can be run. probe_standin.c drives both against fakes. */
+struct ptsname_probe_pty {
+    int pts;
+    char label[64];             /* chardev id, tmux pane, window pid */
+};
+
+int ptsname_probe(long pid, struct ptsname_probe_pty *ptys, int max_ptys,
+                  char const **probe_name);
+int ptsname_probe_qmp(long pid, char const *sock_path,
+                      struct ptsname_probe_pty *ptys, int max_ptys);
+int ptsname_probe_tmux(long pid, char const *sock_path, char const *client,
+                       struct ptsname_probe_pty *ptys, int max_ptys);
+
+/* pty_relay.c: relay a /dev/pts slave to stdio, or to one client of a
+ * listening unix socket at sock_path when it is not NULL */
+int ptmx_relay(char const *pts_path, char const *sock_path);
+
+/* console_server.c: open each slave once and fan it out to unix socket
+ * clients at $dir/pts-$N.sock, keeping `scrollback` bytes per pty */
+int ptmx_serve(char const *const *pts_paths, int num_paths,
+               char const *dir, size_t scrollback);
+
+/* stop_budget.c: pacing of ptrace stops. At most max_stopped tracees are
+ * stopped at once and each target gets budget_usec of stop time per
+ * window_usec (0: unlimited); more latency sensitive classes go first.
+ * mytrace_attach()/mytrace_detach() call enter/leave themselves. */
+struct ptsname_budget {
+    int max_stopped;
+    long budget_usec;
+    long window_usec;
+};
+
+enum {
+    PTSNAME_CLASS_LATENCY,      /* VMs, realtime policies */
+    PTSNAME_CLASS_NORMAL,
+    PTSNAME_CLASS_BATCH,        /* niced, SCHED_BATCH, SCHED_IDLE */
+};
+
+int ptsname_class(long pid);
+void ptsname_budget_set(struct ptsname_budget const *cfg);
+long ptsname_budget_enter(long tid);
+void ptsname_budget_charge(long tgid, long usec);
+void ptsname_budget_leave(long tgid, long uncharged, long total);
+/* every process on the host, in class order, under cfg (NULL: unpaced);
+ * -1 with *entries set if nothing was found, NULL if the scan failed */
+int ptsname_list_host(struct ptsname_budget const *cfg,
+                      struct ptsname_entry **entries, int *num_entries);
+
+/* proc_parse.c: /proc text scanners (SSE2/AVX2 where available). Buffers
+ * need no terminating NUL; -1 / NULL when the field is not there. */
+char const *proc_find(char const *buf, size_t len, char const *key);
+char const *proc_skip(char const *p, char const *end, int num_fields);
+long long proc_num(char const *p, char const *end, char const **next);
+long long proc_key_num(char const *buf, size_t len, char const *key);
+/* fields numbered as in proc(5), ascending, 3 (state) and up */
+int proc_stat_fields(char const *buf, size_t len, int const *fields,
+                     int num, long long *out);
+
+/* a /proc directory, read without a DIR; skips "." and ".." */
+struct proc_dir {
+    int fd;
+    int pos, len;
+    char buf[2048] __attribute__((aligned(8)));
+};
+
+int proc_dir_open(struct proc_dir *d, char const *path);
+char const *proc_dir_next(struct proc_dir *d);
+void proc_dir_close(struct proc_dir *d);
+
+/* proc_uring.c: batched (io_uring where available) first pass over many
+ * processes. pids is cut down in place to those that still need a full
+ * resolution; entries gets what could be answered without one. */
+int ptsname_host_prefilter(long *pids, int *num_pids,
+                           struct ptsname_entry **entries, int *num_entries);
+
+/* pts_timeline.c: a recorder appending fixed size records of every pty
+ * allocation and release it observes, and point-in-time ownership queries
+ * over what it wrote */
+enum {
+    PTS_ALLOC = 1,
+    PTS_RELEASE,
+    PTS_HELD,                   /* already held when a segment started */
+};
+
+struct pts_record {
+    uint64_t ts;                /* usec since the epoch */
+    uint64_t start_time;        /* of pid, see ptsname_start_time() */
+    uint64_t exe_hash;          /* FNV-1a of /proc/$PID/exe */
+    uint64_t dev;               /* devpts instance, 0 if unknown */
+    int32_t pid;
+    int32_t tid;                /* whose fd table held it */
+    int32_t fd;
+    int32_t pts;
+    uint32_t event;
+    uint32_t reserved;
+};
+
+int ptmx_record(char const *dir, long interval_usec,
+                struct ptsname_budget const *cfg);
+int ptsname_timeline_who(char const *dir, uint64_t dev, int pts, uint64_t when,
+                         struct pts_record **owners, int *num_owners);
+
+/* pts_fuse.c: serve $mountpoint/$PID/$FD as symlinks to the slaves,
+ * resolving lazily on readlink; returns once unmounted or signalled */
+int ptmx_fuse(char const *mountpoint);
+
+/* pts_namespace.c: where a resolved pty lives, inside the target's mount
+ * namespace and as reachable from ours (possibly via /proc/$PID/root) */
+struct ptsname_path {
+    dev_t dev;                  /* devpts instance */
+    char ns[PATH_MAX];
+    char host[PATH_MAX];
+};
+
+int ptsname_paths(struct ptsname_entry const *entries, int num_entries,
+                  struct ptsname_path *paths);
+int ptsname_list_cgroup(char const *cgroup, struct ptsname_entry **entries,
+                        int *num_entries);
+
+/* agent.c: opt-in resident thread in the target answering queries over a
+ * unix socket; once installed, the queries need no ptrace stop */
+struct termios;
+int ptmx_agent_install(long pid);
+int ptmx_agent_remove(long pid);
+int ptmx_agent_TIOCGPTN(long pid, int fd, int *pts);
+int ptmx_agent_tcgets(long pid, int fd, struct termios *tos);
+
+/* fd_extract.c: local copies of a target's fds (pidfd_getfd, else one
+ * short stop passing them over SCM_RIGHTS); local_fds[i] is -1 for fds
+ * that were already closed. The caller owns and closes the copies. */
+int ptsname_grab_fds(long pid, long tid, int const *fds, int num_fds,
+                     int *local_fds);
+/* an AF_UNIX socket created in pid's network namespace; aborts if the
+ * calling thread cannot get back to its own */
+int ptmx_socket_in(long pid, int type);
+/* the same for any domain: sock_diag, say, only reports its own netns */
+int ptmx_socket_in_ns(long pid, int domain, int type, int protocol);
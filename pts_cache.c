@@ -0,0 +1,281 @@
+/*
+ * Copyright 2013
+ *  Steven Maresca <steve@zentific.com>
+ *  Zentific LLC
+ *
+ * pts_cache:
+ *  Answers already paid for, kept for as long as they stay true.
+ *
+ *  Each pid:fd -> pts answer is stored with the generation it was found
+ *  in: the process start time, the master's dev/inode and its mnt_id.
+ *  Whoever asks again passes the generation they see now, and a stale
+ *  entry simply misses. The table is direct mapped, so a collision costs
+ *  one more resolution and nothing else.
+ *
+ *  None of that tells a master closed and reopened under the same fd: it
+ *  keeps start time, inode (every /dev/ptmx open shares it) and mnt_id.
+ *  The slave does tell. devpts removes the slave node when its master
+ *  goes, and a new pty, even one given the same index back, gets a new
+ *  node with a new ctime. So an answer is stored with the slave node it
+ *  names, as seen in the target's root (device, inode, ctime), and only
+ *  given back while that node is still there unchanged. A node whose ctime
+ *  is not older than the question was made or changed while we resolved,
+ *  and may already belong to some other master: such answers are not kept.
+ *  A chmod of the slave (mesg, say) costs one resolution more.
+ *
+ *  What this cannot see is the old master kept open elsewhere, by a child
+ *  or over a socket, while a new one is moved onto the same fd: the old
+ *  slave lives on untouched. Callers ask fdinfo for tty-index first and
+ *  only consult the cache where the kernel does not say.
+ *
+ *  Between runs the table lives in a file (PTSNAME_CACHE_FILE), stamped
+ *  with the boot id since start times only mean something within a boot.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "ptmx_resolve.h"
+
+#define CACHE_SLOTS 4096        /* direct mapped, power of two */
+#define CACHE_MAGIC 0x32435450u /* "PTC2" */
+
+/* as stored on disk, too */
+struct cache_entry {
+    int32_t pid;                /* 0: empty slot */
+    int32_t fd;
+    int32_t pts;
+    int32_t mnt_id;
+    uint64_t start_time;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t slave_dev;         /* the slave node the answer names */
+    uint64_t slave_ino;
+    int64_t slave_sec;          /* its ctime */
+    int64_t slave_nsec;
+};
+
+struct cache_header {
+    uint32_t magic;
+    uint32_t count;
+    char boot_id[40];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    int dirty;
+    struct cache_entry slots[CACHE_SLOTS];
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static struct cache_entry *cache_slot(long pid, int fd) {
+    uint64_t h = (uint64_t)pid * 0x9e3779b97f4a7c15ull ^ (uint64_t)fd;
+
+    return &cache.slots[(h ^ h >> 29) & (CACHE_SLOTS - 1)];
+}
+
+static int gen_match(struct cache_entry const *e, long pid, int fd,
+                     struct ptsname_gen const *gen) {
+    return e->pid == pid && e->fd == fd && e->start_time == gen->start_time
+        && e->dev == gen->dev && e->ino == gen->ino
+        && e->mnt_id == gen->mnt_id;
+}
+
+/* slave pts of pid, in its own root: where its programs would open it */
+static int slave_stat(long pid, int pts, struct stat *st) {
+    char path[64];
+
+    snprintf(path, sizeof(path), "/proc/%ld/root/dev/pts/%d", pid, pts);
+
+    return stat(path, st);
+}
+
+static int slave_match(struct cache_entry const *e, struct stat const *st) {
+    return e->slave_dev == st->st_dev && e->slave_ino == st->st_ino
+        && e->slave_sec == st->st_ctim.tv_sec
+        && e->slave_nsec == st->st_ctim.tv_nsec;
+}
+
+/* the kernel stamps ctime from the coarse clock; this is the same one */
+void ptsname_gen_now(struct ptsname_gen *gen) {
+    clock_gettime(CLOCK_REALTIME_COARSE, &gen->asked);
+}
+
+int ptsname_cache_get(long pid, int fd, struct ptsname_gen const *gen,
+                      int *pts_id) {
+    struct cache_entry *e = cache_slot(pid, fd), hit;
+    struct stat st;
+    int ret = -1;
+
+    pthread_mutex_lock(&cache.lock);
+    if (gen_match(e, pid, fd, gen)) {
+        hit = *e;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    if (ret < 0)
+        return -1;
+    if (slave_stat(pid, hit.pts, &st) < 0 || !slave_match(&hit, &st)) {
+        debug("cache: %ld/%d -> %d, but that slave is gone", pid, fd,
+              hit.pts);
+        return -1;
+    }
+    *pts_id = hit.pts;
+
+    debug("cache: %ld/%d -> %d", pid, fd, *pts_id);
+
+    return 0;
+}
+
+void ptsname_cache_put(long pid, int fd, struct ptsname_gen const *gen,
+                       int pts_id) {
+    struct cache_entry *e = cache_slot(pid, fd);
+    struct stat st;
+
+    if (pts_id < 0 || slave_stat(pid, pts_id, &st) < 0)
+        return;
+    /* made or changed since the question: perhaps another master's now */
+    if (st.st_ctim.tv_sec > gen->asked.tv_sec
+        || (st.st_ctim.tv_sec == gen->asked.tv_sec
+            && st.st_ctim.tv_nsec >= gen->asked.tv_nsec))
+        return;
+
+    pthread_mutex_lock(&cache.lock);
+    if (!gen_match(e, pid, fd, gen) || e->pts != pts_id
+        || !slave_match(e, &st)) {
+        e->pid = pid;
+        e->fd = fd;
+        e->pts = pts_id;
+        e->mnt_id = gen->mnt_id;
+        e->start_time = gen->start_time;
+        e->dev = gen->dev;
+        e->ino = gen->ino;
+        e->slave_dev = st.st_dev;
+        e->slave_ino = st.st_ino;
+        e->slave_sec = st.st_ctim.tv_sec;
+        e->slave_nsec = st.st_ctim.tv_nsec;
+        cache.dirty = 1;
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+static int boot_id(char *buf, size_t size) {
+    ssize_t n;
+    int fd;
+
+    memset(buf, 0, size);
+    fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    n = read(fd, buf, size - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    if (buf[n - 1] == '\n')
+        buf[n - 1] = '\0';
+
+    return 0;
+}
+
+/* merge a saved table into this one; a missing file is not an error */
+int ptsname_cache_load(char const *path) {
+    struct cache_header hdr;
+    struct cache_entry e;
+    char boot[sizeof(hdr.boot_id)];
+    FILE *f;
+    int ret = -1;
+
+    f = fopen(path, "re");
+    if (!f)
+        return errno == ENOENT ? 0 : -1;
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != CACHE_MAGIC
+        || boot_id(boot, sizeof(boot)) < 0
+        || memcmp(boot, hdr.boot_id, sizeof(boot))) {
+        debug("cache: %s is from another boot or not a cache", path);
+        goto wrap_up;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    for (uint32_t i = 0; i < hdr.count && fread(&e, sizeof(e), 1, f) == 1;
+         i++) {
+        struct cache_entry *slot = cache_slot(e.pid, e.fd);
+
+        /* what this run learned already is newer */
+        if (!slot->pid && e.pid > 0)
+            *slot = e;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    ret = 0;
+
+wrap_up:
+    fclose(f);
+
+    return ret;
+}
+
+/* write the table out if anything was learned, replacing path atomically */
+int ptsname_cache_save(char const *path) {
+    struct cache_header hdr = { .magic = CACHE_MAGIC };
+    char tmp[PATH_MAX];
+    FILE *f;
+    int ret = -1;
+    int fd;
+
+    if (!cache.dirty)
+        return 0;
+    if (boot_id(hdr.boot_id, sizeof(hdr.boot_id)) < 0)
+        return -1;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        /* not root: the table was still good for this run */
+        if (errno != EACCES && errno != EROFS)
+            fprintf(stderr, "%s - cannot create %s: %s\n", __FUNCTION__,
+                    tmp, strerror(errno));
+        return -1;
+    }
+    f = fdopen(fd, "w");
+    if (!f) {
+        close(fd);
+        goto wrap_up;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    for (int i = 0; i < CACHE_SLOTS; i++)
+        hdr.count += cache.slots[i].pid != 0;
+    if (fwrite(&hdr, sizeof(hdr), 1, f) == 1) {
+        ret = 0;
+        for (int i = 0; i < CACHE_SLOTS && ret == 0; i++) {
+            if (cache.slots[i].pid
+                && fwrite(&cache.slots[i], sizeof(cache.slots[i]), 1, f) != 1)
+                ret = -1;
+        }
+    }
+    if (ret == 0)
+        cache.dirty = 0;
+    pthread_mutex_unlock(&cache.lock);
+
+    if (fclose(f) != 0)
+        ret = -1;
+    if (ret == 0 && rename(tmp, path) < 0)
+        ret = -1;
+
+wrap_up:
+    if (ret < 0) {
+        fprintf(stderr, "%s - cannot write %s\n", __FUNCTION__, path);
+        unlink(tmp);
+    }
+
+    return ret;
+}
@@ -0,0 +1,647 @@
+/*
+ * Copyright 2013
+ *  Steven Maresca <steve@zentific.com>
+ *  Zentific LLC
+ *
+ * pts_fuse:
+ *  A filesystem of readlink-able answers: $MNT/$PID/$FD is a symlink to
+ *  the slave of master $FD of $PID, so scripts and hooks need nothing
+ *  more than readlink(1).
+ *
+ *  The /dev/fuse protocol is spoken directly; there is no libfuse here.
+ *  Nothing is resolved until an entry is read, and then by the cheapest
+ *  method that answers (fdinfo, agent, fd copy, injection). Answers are
+ *  kept per (pid, start time, fd, master inode), but that alone cannot
+ *  tell a master closed and reopened under the same fd: every open of
+ *  /dev/ptmx reaches the same inode. The slave node can, since devpts
+ *  drops it when its master goes, so a kept answer is only used while the
+ *  slave it names is the very node (inode, ctime) it was when resolved.
+ *  Where fdinfo carries tty-index, that is read instead, as it is cheaper
+ *  still. What this cannot see is the old master kept open elsewhere while
+ *  a new one is moved onto the same fd.
+ *
+ *  A directory is listed once per opendir (and again on a rewind); the
+ *  continuation reads that follow are served from that listing.
+ *
+ *  The mount is open to all users (allow_other), but a request is only
+ *  served for processes the requester owns, as /proc/$PID says; root is
+ *  served everything.
+ */
+
+#define _GNU_SOURCE             /* O_DIRECTORY, umount2() */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <linux/fuse.h>
+#include <linux/major.h>
+
+#include "ptmx_resolve.h"
+
+#define FUSE_MAX_WRITE   65536
+#define FUSE_BUF_SIZE    (FUSE_MAX_WRITE + 4096)
+#define FUSE_CACHE_SLOTS 4096   /* direct mapped, power of two */
+#define FUSE_TTL_SEC     1      /* how long the kernel may keep our answers */
+
+/* nodeids are derived, never allocated: (pid << 32) | (fd + 1) */
+#define NODE_PID(n)      ((long)((n) >> 32))
+#define NODE_FD(n)       ((int)((n) & 0xffffffff) - 1)
+#define NODE(pid, fd)    ((uint64_t)(pid) << 32 | (uint32_t)((fd) + 1))
+
+struct fuse_link {
+    long pid;                   /* 0: empty slot */
+    int fd;
+    int pts;
+    unsigned long long start_time;
+    dev_t dev;                  /* the master's inode */
+    ino_t ino;
+    dev_t slave_dev;            /* the slave node it was resolved to */
+    ino_t slave_ino;
+    struct timespec slave_ctime;
+    char *slave;                /* that node, through /proc/$PID/root */
+    char *target;
+};
+
+/* one opendir's entries, as fuse_dirents; the fh the kernel hands back */
+struct fuse_listing {
+    char *buf;
+    size_t len, max;
+    uint64_t num;
+    int built;
+};
+
+static struct fuse_link fuse_cache[FUSE_CACHE_SLOTS];
+static volatile sig_atomic_t fuse_stop = 0;
+
+static void fuse_sighandler(int sig) {
+    (void)sig;
+    fuse_stop = 1;
+}
+
+static struct fuse_link *cache_slot(long pid, int fd) {
+    uint64_t h = (uint64_t)pid * 0x9e3779b97f4a7c15ull ^ (uint64_t)fd;
+
+    return &fuse_cache[(h ^ h >> 29) & (FUSE_CACHE_SLOTS - 1)];
+}
+
+/* a master of pid, by the node it reaches; 0 if fd is anything else */
+static int master_stat(long pid, int fd, struct stat *st) {
+    char path[64];
+
+    snprintf(path, sizeof(path), "/proc/%ld/fd/%d", pid, fd);
+    if (stat(path, st) < 0)
+        return 0;
+
+    return S_ISCHR(st->st_mode) && major(st->st_rdev) == TTYAUX_MAJOR
+        && minor(st->st_rdev) == 2;
+}
+
+/* may the requester see pid at all: root, or the owner of /proc/$PID */
+static int fuse_allowed(struct fuse_in_header const *in, long pid) {
+    struct stat st;
+    char path[64];
+
+    if (in->uid == 0)
+        return 1;
+    snprintf(path, sizeof(path), "/proc/%ld", pid);
+
+    return stat(path, &st) == 0 && st.st_uid == in->uid;
+}
+
+/* the slave node l was resolved to, as it is now; 0 if it is gone */
+static int link_slave(struct fuse_link const *l, struct stat *st) {
+    return l->slave && stat(l->slave, st) == 0;
+}
+
+/* is that still the very node l was resolved to */
+static int link_current(struct fuse_link const *l, struct stat const *st) {
+    return st->st_dev == l->slave_dev && st->st_ino == l->slave_ino
+        && st->st_ctim.tv_sec == l->slave_ctime.tv_sec
+        && st->st_ctim.tv_nsec == l->slave_ctime.tv_nsec;
+}
+
+/* note the slave node l stands for; without one, nothing is kept */
+static void link_stamp(struct fuse_link *l, int have, struct stat const *st) {
+    if (have) {
+        l->slave_dev = st->st_dev;
+        l->slave_ino = st->st_ino;
+        l->slave_ctime = st->st_ctim;
+    } else {
+        free(l->slave);
+        l->slave = NULL;
+    }
+}
+
+/* the symlink target for pid:fd; the path is built once per answer */
+static char const *link_target(long pid, int fd) {
+    struct fuse_link *l = cache_slot(pid, fd);
+    struct ptsname_entry entry;
+    struct ptsname_path path;
+    unsigned long long start_time;
+    struct stat st, slave;
+    char node[PATH_MAX + 32];
+    int same, have = 0, pts = -1;
+
+    if (!master_stat(pid, fd, &st) || ptsname_start_time(pid, &start_time) < 0)
+        return NULL;
+
+    same = l->pid == pid && l->fd == fd && l->start_time == start_time
+        && l->dev == st.st_dev && l->ino == st.st_ino;
+    /* looked at before resolving: a reopen in between only costs a miss */
+    if (same)
+        have = link_slave(l, &slave);
+
+    /* fdinfo is the cheapest answer of all; without it, a kept one whose
+     * slave is untouched saves a stop of the target */
+    if (ptsname_fdinfo(pid, pid, fd, &pts) < 0) {
+        if (have && link_current(l, &slave))
+            return l->target;
+        if (ptsname_by_fd(pid, fd, &pts) < 0)
+            return NULL;
+    }
+
+    /* the same answer, perhaps for a newer slave node */
+    if (same && l->pts == pts) {
+        link_stamp(l, have, &slave);
+        return l->target;
+    }
+
+    entry.pid = entry.tid = pid;
+    entry.fd = fd;
+    entry.pts = pts;
+    ptsname_paths(&entry, 1, &path);
+
+    free(l->target);
+    free(l->slave);
+    l->slave = NULL;
+    l->target = strdup(path.host);
+    if (!l->target) {
+        l->pid = 0;
+        return NULL;
+    }
+    l->pid = pid;
+    l->fd = fd;
+    l->pts = pts;
+    l->start_time = start_time;
+    l->dev = st.st_dev;
+    l->ino = st.st_ino;
+
+    /* no slave to check against means the next readlink resolves again */
+    snprintf(node, sizeof(node), "/proc/%ld/root%s", pid, path.ns);
+    l->slave = strdup(node);
+    link_stamp(l, link_slave(l, &slave), &slave);
+
+    debug("fuse: %ld/%d -> %s", pid, fd, l->target);
+
+    return l->target;
+}
+
+static int fuse_reply(int dev, uint64_t unique, int error,
+                      void const *arg, size_t len) {
+    struct fuse_out_header out;
+    struct iovec iov[2];
+
+    out.len = sizeof(out) + (error ? 0 : len);
+    out.error = error;
+    out.unique = unique;
+    iov[0].iov_base = &out;
+    iov[0].iov_len = sizeof(out);
+    iov[1].iov_base = (void *)arg;
+    iov[1].iov_len = error ? 0 : len;
+
+    /* ENOENT here only means the request was interrupted meanwhile */
+    if (writev(dev, iov, 2) < 0 && errno != ENOENT) {
+        perror("/dev/fuse");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* attributes of node, or -ENOENT once what it stood for is gone */
+static int node_attr(uint64_t node, struct fuse_attr *attr) {
+    struct fuse_link *l;
+    struct stat st;
+    char path[64];
+    long pid = NODE_PID(node);
+    int fd = NODE_FD(node);
+
+    memset(attr, 0, sizeof(*attr));
+    attr->ino = node;
+    attr->nlink = 1;
+    attr->blksize = 4096;
+
+    if (node == FUSE_ROOT_ID) {
+        attr->mode = S_IFDIR | 0555;
+        attr->nlink = 2;
+        return 0;
+    }
+
+    if (fd < 0) {
+        snprintf(path, sizeof(path), "/proc/%ld", pid);
+        if (stat(path, &st) < 0)
+            return -ENOENT;
+        attr->mode = S_IFDIR | 0555;
+        attr->nlink = 2;
+        attr->uid = st.st_uid;
+        attr->gid = st.st_gid;
+        attr->mtime = attr->ctime = st.st_mtime;
+        return 0;
+    }
+
+    /* cheap: resolution is left for readlink, size is a best guess */
+    if (!master_stat(pid, fd, &st))
+        return -ENOENT;
+    l = cache_slot(pid, fd);
+    attr->mode = S_IFLNK | 0777;
+    attr->uid = st.st_uid;
+    attr->gid = st.st_gid;
+    attr->size = l->pid == pid && l->fd == fd ? strlen(l->target) : 0;
+    attr->mtime = attr->ctime = st.st_mtime;
+
+    return 0;
+}
+
+static void fuse_lookup(int dev, struct fuse_in_header *in, char const *name) {
+    struct fuse_entry_out out;
+    char *end;
+    long n;
+    int err;
+
+    n = strtol(name, &end, 10);
+    if (*end || end == name || n < 0
+        || (in->nodeid == FUSE_ROOT_ID ? n == 0 || n > INT32_MAX
+            : NODE_FD(in->nodeid) >= 0 || n >= INT32_MAX)) {
+        fuse_reply(dev, in->unique, -ENOENT, NULL, 0);
+        return;
+    }
+
+    memset(&out, 0, sizeof(out));
+    out.nodeid = in->nodeid == FUSE_ROOT_ID ? NODE(n, -1)
+                                            : NODE(NODE_PID(in->nodeid), n);
+    if (!fuse_allowed(in, NODE_PID(out.nodeid))) {
+        fuse_reply(dev, in->unique, -EACCES, NULL, 0);
+        return;
+    }
+    out.entry_valid = out.attr_valid = FUSE_TTL_SEC;
+
+    err = node_attr(out.nodeid, &out.attr);
+    fuse_reply(dev, in->unique, err, &out, sizeof(out));
+}
+
+static void fuse_getattr(int dev, struct fuse_in_header *in) {
+    struct fuse_attr_out out;
+    int err;
+
+    if (in->nodeid != FUSE_ROOT_ID && !fuse_allowed(in, NODE_PID(in->nodeid))) {
+        fuse_reply(dev, in->unique, -EACCES, NULL, 0);
+        return;
+    }
+    memset(&out, 0, sizeof(out));
+    out.attr_valid = FUSE_TTL_SEC;
+    err = node_attr(in->nodeid, &out.attr);
+    fuse_reply(dev, in->unique, err, &out, sizeof(out));
+}
+
+static void fuse_readlink(int dev, struct fuse_in_header *in) {
+    char const *target = NULL;
+
+    if (in->nodeid != FUSE_ROOT_ID && !fuse_allowed(in, NODE_PID(in->nodeid))) {
+        fuse_reply(dev, in->unique, -EACCES, NULL, 0);
+        return;
+    }
+    if (in->nodeid != FUSE_ROOT_ID && NODE_FD(in->nodeid) >= 0)
+        target = link_target(NODE_PID(in->nodeid), NODE_FD(in->nodeid));
+
+    if (!target)
+        fuse_reply(dev, in->unique, -ENOENT, NULL, 0);
+    else
+        fuse_reply(dev, in->unique, 0, target, strlen(target));
+}
+
+/* append one dirent to the listing; its off is the index of the next */
+static int listing_add(struct fuse_listing *l, uint64_t ino,
+                       unsigned int type, char const *name) {
+    struct fuse_dirent *d;
+    size_t namelen = strlen(name);
+    size_t reclen = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + namelen);
+
+    if (l->len + reclen > l->max) {
+        size_t max = l->max ? l->max * 2 : 4096;
+        char *buf;
+
+        while (l->len + reclen > max)
+            max *= 2;
+        buf = realloc(l->buf, max);
+        if (!buf)
+            return -1;
+        l->buf = buf;
+        l->max = max;
+    }
+
+    d = (struct fuse_dirent *)(l->buf + l->len);
+    d->ino = ino;
+    d->off = ++l->num;
+    d->namelen = namelen;
+    d->type = type;
+    memcpy(d->name, name, namelen);
+    memset(d->name + namelen, 0, reclen - FUSE_NAME_OFFSET - namelen);
+    l->len += reclen;
+
+    return 0;
+}
+
+/* a pid gets a directory only if it holds at least one master */
+static int has_master(long pid) {
+    struct dirent *de;
+    struct stat st;
+    char path[64];
+    DIR *d;
+    int found = 0;
+
+    snprintf(path, sizeof(path), "/proc/%ld/fd", pid);
+    d = opendir(path);
+    if (!d)
+        return 0;
+    while (!found && (de = readdir(d)))
+        found = de->d_name[0] != '.'
+            && master_stat(pid, atoi(de->d_name), &st);
+    closedir(d);
+
+    return found;
+}
+
+/*
+ * List a directory into l: the root once costs a walk of every process's
+ * fds, which is why it is done once per opendir and not per read.
+ */
+static int listing_build(struct fuse_in_header const *in,
+                         struct fuse_listing *l) {
+    long pid = NODE_PID(in->nodeid);
+    struct dirent *de;
+    struct stat st;
+    char path[64];
+    DIR *d;
+    int ret = 0;
+
+    l->len = 0;
+    l->num = 0;
+    l->built = 1;
+
+    if (in->nodeid == FUSE_ROOT_ID)
+        snprintf(path, sizeof(path), "/proc");
+    else
+        snprintf(path, sizeof(path), "/proc/%ld/fd", pid);
+
+    d = opendir(path);
+    if (!d)
+        return -ENOENT;
+
+    if (listing_add(l, in->nodeid, DT_DIR, ".") < 0
+        || listing_add(l, FUSE_ROOT_ID, DT_DIR, "..") < 0)
+        ret = -ENOMEM;
+
+    while (ret == 0 && (de = readdir(d))) {
+        long n;
+        char *end;
+
+        n = strtol(de->d_name, &end, 10);
+        if (*end || end == de->d_name)
+            continue;
+        if (in->nodeid == FUSE_ROOT_ID ? !fuse_allowed(in, n) || !has_master(n)
+                                       : !master_stat(pid, n, &st))
+            continue;
+        if (listing_add(l, in->nodeid == FUSE_ROOT_ID ? NODE(n, -1)
+                                                      : NODE(pid, n),
+                        in->nodeid == FUSE_ROOT_ID ? DT_DIR : DT_LNK,
+                        de->d_name) < 0)
+            ret = -ENOMEM;
+    }
+    closedir(d);
+
+    return ret;
+}
+
+static void fuse_opendir(int dev, struct fuse_in_header *in) {
+    struct fuse_open_out out;
+    struct fuse_listing *l;
+
+    if (in->nodeid != FUSE_ROOT_ID && !fuse_allowed(in, NODE_PID(in->nodeid))) {
+        fuse_reply(dev, in->unique, -EACCES, NULL, 0);
+        return;
+    }
+    l = calloc(1, sizeof(*l));
+    if (!l) {
+        fuse_reply(dev, in->unique, -ENOMEM, NULL, 0);
+        return;
+    }
+
+    memset(&out, 0, sizeof(out));
+    out.fh = (uintptr_t)l;
+    fuse_reply(dev, in->unique, 0, &out, sizeof(out));
+}
+
+static void fuse_releasedir(int dev, struct fuse_in_header *in,
+                            struct fuse_release_in *rel) {
+    struct fuse_listing *l = (struct fuse_listing *)(uintptr_t)rel->fh;
+
+    if (l) {
+        free(l->buf);
+        free(l);
+    }
+    fuse_reply(dev, in->unique, 0, NULL, 0);
+}
+
+/*
+ * Served from the opendir's listing: off is simply the index of the next
+ * entry. Reading from 0 again (rewinddir) lists the directory afresh.
+ */
+static void fuse_readdir(int dev, struct fuse_in_header *in,
+                         struct fuse_read_in *rd) {
+    struct fuse_listing *l = (struct fuse_listing *)(uintptr_t)rd->fh;
+    size_t size = rd->size < FUSE_MAX_WRITE ? rd->size : FUSE_MAX_WRITE;
+    size_t start = 0, end;
+    uint64_t i;
+    int err;
+
+    if (!l) {
+        fuse_reply(dev, in->unique, -EBADF, NULL, 0);
+        return;
+    }
+    if (rd->offset == 0 || !l->built) {
+        err = listing_build(in, l);
+        if (err < 0) {
+            fuse_reply(dev, in->unique, err, NULL, 0);
+            return;
+        }
+    }
+
+    /* whole records from entry off on, as many as fit */
+    for (i = 0; i < rd->offset && start < l->len; i++)
+        start += FUSE_DIRENT_SIZE((struct fuse_dirent *)(l->buf + start));
+    end = start;
+    while (end < l->len) {
+        size_t reclen = FUSE_DIRENT_SIZE((struct fuse_dirent *)(l->buf + end));
+
+        if (end + reclen - start > size)
+            break;
+        end += reclen;
+    }
+
+    fuse_reply(dev, in->unique, 0, l->buf + start, end - start);
+}
+
+static void fuse_init(int dev, struct fuse_in_header *in,
+                      struct fuse_init_in *init) {
+    struct fuse_init_out out;
+
+    if (init->major != FUSE_KERNEL_VERSION) {
+        fprintf(stderr, "%s - unsupported fuse protocol %u.%u\n",
+                __FUNCTION__, init->major, init->minor);
+        fuse_reply(dev, in->unique, -EPROTO, NULL, 0);
+        fuse_stop = 1;
+        return;
+    }
+
+    memset(&out, 0, sizeof(out));
+    out.major = FUSE_KERNEL_VERSION;
+    out.minor = FUSE_KERNEL_MINOR_VERSION;
+    out.max_readahead = init->max_readahead;
+    out.max_write = FUSE_MAX_WRITE;
+    out.max_background = 16;
+    out.congestion_threshold = 12;
+    out.time_gran = 1;
+
+    debug("fuse: kernel protocol %u.%u", init->major, init->minor);
+
+    fuse_reply(dev, in->unique, 0, &out, sizeof(out));
+}
+
+static void fuse_dispatch(int dev, char *buf) {
+    struct fuse_in_header *in = (struct fuse_in_header *)buf;
+    void *arg = buf + sizeof(*in);
+    struct fuse_statfs_out statfs_out;
+
+    switch (in->opcode) {
+    case FUSE_INIT:
+        fuse_init(dev, in, arg);
+        break;
+    case FUSE_LOOKUP:
+        fuse_lookup(dev, in, arg);
+        break;
+    case FUSE_GETATTR:
+        fuse_getattr(dev, in);
+        break;
+    case FUSE_READLINK:
+        fuse_readlink(dev, in);
+        break;
+    case FUSE_OPENDIR:
+        fuse_opendir(dev, in);
+        break;
+    case FUSE_READDIR:
+        fuse_readdir(dev, in, arg);
+        break;
+    case FUSE_RELEASEDIR:
+        fuse_releasedir(dev, in, arg);
+        break;
+    case FUSE_STATFS:
+        memset(&statfs_out, 0, sizeof(statfs_out));
+        statfs_out.st.bsize = statfs_out.st.frsize = 4096;
+        statfs_out.st.namelen = 255;
+        fuse_reply(dev, in->unique, 0, &statfs_out, sizeof(statfs_out));
+        break;
+    case FUSE_FORGET:
+    case FUSE_BATCH_FORGET:
+        /* nodeids are not reference counted here, and these get no reply */
+        break;
+    case FUSE_DESTROY:
+        fuse_stop = 1;
+        fuse_reply(dev, in->unique, 0, NULL, 0);
+        break;
+    default:
+        fuse_reply(dev, in->unique, -ENOSYS, NULL, 0);
+        break;
+    }
+}
+
+int ptmx_fuse(char const *mountpoint) {
+    struct sigaction sa;
+    char opts[128];
+    char *buf = NULL;
+    int dev, ret = -1;
+    ssize_t n;
+
+    if (mkdir(mountpoint, 0755) < 0 && errno != EEXIST) {
+        perror(mountpoint);
+        return -1;
+    }
+
+    dev = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+    if (dev < 0) {
+        perror("/dev/fuse");
+        return -1;
+    }
+
+    snprintf(opts, sizeof(opts),
+             "fd=%d,rootmode=%o,user_id=0,group_id=0,allow_other",
+             dev, S_IFDIR | 0555);
+    if (mount("ptmx_resolve", mountpoint, "fuse.ptmx_resolve",
+              MS_NOSUID | MS_NODEV | MS_NOEXEC | MS_RDONLY, opts) < 0) {
+        perror("mount");
+        close(dev);
+        return -1;
+    }
+
+    buf = malloc(FUSE_BUF_SIZE);
+    if (!buf)
+        goto wrap_up;
+
+    /* no SA_RESTART: a signal has to get us out of read() */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = fuse_sighandler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf("serving %s\n", mountpoint);
+    fflush(stdout);
+
+    while (!fuse_stop) {
+        n = read(dev, buf, FUSE_BUF_SIZE);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == ENOENT))
+            continue;
+        if (n < 0) {
+            /* ENODEV: unmounted from outside */
+            if (errno != ENODEV)
+                perror("/dev/fuse");
+            break;
+        }
+        if ((size_t)n < sizeof(struct fuse_in_header))
+            continue;
+        fuse_dispatch(dev, buf);
+    }
+
+    ret = 0;
+
+wrap_up:
+    umount2(mountpoint, MNT_DETACH);
+    close(dev);
+    free(buf);
+    for (int i = 0; i < FUSE_CACHE_SLOTS; i++) {
+        free(fuse_cache[i].target);
+        free(fuse_cache[i].slave);
+    }
+
+    return ret;
+}
@@ -0,0 +1,420 @@
+/*
+ * Copyright 2013
+ *  Steven Maresca <steve@zentific.com>
+ *  Zentific LLC
+ *
+ * pts_namespace:
+ *  Container-aware view of resolved ptys.
+ *
+ *  A pts number only means something relative to the devpts instance it
+ *  was allocated from. The instance is found from the master itself: the
+ *  mount it was opened through (fdinfo mnt_id), or, for a devtmpfs
+ *  /dev/ptmx, the "pts" directory beside it. That instance is then looked
+ *  up by st_dev in the target's /proc/$PID/mountinfo (path inside the
+ *  container) and in our own (path on the host). Instances not mounted on
+ *  the host at all are still reachable through /proc/$PID/root.
+ *
+ *  Also: resolving every process of a cgroup subtree in one pass.
+ */
+
+#define _GNU_SOURCE             /* getline(), memmem() */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+
+#include "ptmx_resolve.h"
+
+struct mnt_entry {
+    int id;
+    dev_t dev;
+    char *root;             /* path within the filesystem */
+    char *point;            /* mount point */
+    char *fstype;
+};
+
+struct mnt_table {
+    struct mnt_entry *m;
+    int num;
+};
+
+/* mountinfo escapes ' ', '\t', '\n' and '\\' as \ooo */
+static void mnt_unescape(char *s) {
+    char *d = s;
+
+    while (*s) {
+        if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3'
+            && s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+            *d++ = (s[1] - '0') << 6 | (s[2] - '0') << 3 | (s[3] - '0');
+            s += 4;
+        } else {
+            *d++ = *s++;
+        }
+    }
+    *d = '\0';
+}
+
+static void mnt_table_free(struct mnt_table *t) {
+    for (int i = 0; i < t->num; i++) {
+        free(t->m[i].root);
+        free(t->m[i].point);
+        free(t->m[i].fstype);
+    }
+    free(t->m);
+    t->m = NULL;
+    t->num = 0;
+}
+
+static int mnt_table_load(char const *path, struct mnt_table *t) {
+    FILE *f;
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t n;
+    int max = 0;
+
+    t->m = NULL;
+    t->num = 0;
+
+    f = fopen(path, "re");
+    if (!f)
+        return -1;
+
+    while ((n = getline(&line, &len, f)) > 0) {
+        char const *end = line + n;
+        char const *p, *root, *point, *fstype, *root_end, *point_end, *sep;
+        struct mnt_entry e;
+        long long maj, min;
+
+        /* 36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw */
+        if (end[-1] == '\n')
+            end--;
+        e.id = proc_num(line, end, &p);
+        p = p ? proc_skip(p, end, 2) : NULL;
+        maj = p ? proc_num(p, end, &p) : -1;
+        min = p && *p == ':' ? proc_num(p + 1, end, &p) : -1;
+        if (min < 0 || maj < 0 || p == end)
+            continue;
+
+        root = p + 1;
+        root_end = memchr(root, ' ', end - root);
+        point = root_end ? root_end + 1 : end;
+        point_end = memchr(point, ' ', end - point);
+        sep = point_end ? memmem(point_end, end - point_end, " - ", 3) : NULL;
+        if (!sep)
+            continue;
+        fstype = sep + 3;
+        p = memchr(fstype, ' ', end - fstype);
+
+        e.root = strndup(root, root_end - root);
+        e.point = strndup(point, point_end - point);
+        e.fstype = strndup(fstype, (p ? p : end) - fstype);
+        if (!e.root || !e.point || !e.fstype) {
+            free(e.root);
+            free(e.point);
+            free(e.fstype);
+            continue;
+        }
+
+        mnt_unescape(e.root);
+        mnt_unescape(e.point);
+        e.dev = makedev(maj, min);
+
+        if (t->num == max) {
+            struct mnt_entry *m;
+            max = max ? 2 * max : 64;
+            m = realloc(t->m, max * sizeof(*m));
+            if (!m) {
+                free(e.root);
+                free(e.point);
+                free(e.fstype);
+                break;
+            }
+            t->m = m;
+        }
+        t->m[t->num++] = e;
+    }
+
+    free(line);
+    fclose(f);
+
+    return 0;
+}
+
+static struct mnt_entry *mnt_by_id(struct mnt_table *t, int id) {
+    for (int i = 0; i < t->num; i++) {
+        if (t->m[i].id == id)
+            return &t->m[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * The devpts mount of instance `dev` showing its whole tree, preferring one
+ * mounted at `want`. Later entries shadow earlier ones at the same point.
+ */
+static struct mnt_entry *mnt_devpts(struct mnt_table *t, dev_t dev,
+                                    char const *want) {
+    struct mnt_entry *found = NULL;
+
+    for (int i = 0; i < t->num; i++) {
+        struct mnt_entry *m = &t->m[i];
+
+        if (strcmp(m->fstype, "devpts") || m->dev != dev
+            || strcmp(m->root, "/"))
+            continue;
+        if (found && want && !strcmp(found->point, want)
+            && strcmp(m->point, want))
+            continue;
+        found = m;
+    }
+
+    return found;
+}
+
+static struct mnt_entry *mnt_devpts_at(struct mnt_table *t, char const *point) {
+    struct mnt_entry *found = NULL;
+
+    for (int i = 0; i < t->num; i++) {
+        if (!strcmp(t->m[i].fstype, "devpts") && !strcmp(t->m[i].point, point))
+            found = &t->m[i];
+    }
+
+    return found;
+}
+
+static int fdinfo_mnt_id(long pid, long tid, int fd) {
+    char path[64], buf[512];
+    ssize_t n;
+    int mnt_id = -1;
+    int f;
+
+    snprintf(path, sizeof(path), "/proc/%ld/task/%ld/fdinfo/%d", pid, tid, fd);
+    f = open(path, O_RDONLY | O_CLOEXEC);
+    if (f < 0)
+        return -1;
+    n = read(f, buf, sizeof(buf));
+    close(f);
+    if (n <= 0)
+        return -1;
+
+    mnt_id = proc_key_num(buf, n, "mnt_id:");
+
+    return mnt_id;
+}
+
+/* Work out which devpts instance, and where, the master pid:fd came from */
+static int resolve_devpts(long pid, long tid, int fd, struct mnt_table *ns,
+                          struct mnt_table *host, struct ptsname_path *out) {
+    char path[PATH_MAX], link[PATH_MAX], sibling[PATH_MAX];
+    struct mnt_entry *m = NULL, *hm;
+    struct stat st;
+    char *slash;
+    ssize_t n;
+
+    snprintf(path, sizeof(path), "/proc/%ld/task/%ld/fd/%d", pid, tid, fd);
+    n = readlink(path, link, sizeof(link) - 1);
+    if (n < 0)
+        return -1;
+    link[n] = '\0';
+
+    /* "/dev/ptmx" -> "/dev/pts", the directory the kernel looks in */
+    snprintf(sibling, sizeof(sibling), "%s", link);
+    slash = strrchr(sibling, '/');
+    if (slash)
+        *slash = '\0';
+    slash = strrchr(sibling, '/');
+    if ((!slash || strcmp(slash, "/pts"))
+        && strlen(sibling) + 4 < sizeof(sibling))
+        strcat(sibling, "/pts");
+
+    /* opened through devpts itself: /dev/pts/ptmx or a bind of it */
+    m = mnt_by_id(ns, fdinfo_mnt_id(pid, tid, fd));
+    if (m && strcmp(m->fstype, "devpts"))
+        m = NULL;
+    if (!m)
+        m = mnt_devpts_at(ns, sibling);
+
+    if (m) {
+        out->dev = m->dev;
+    } else {
+        /* no mountinfo to go by: ask the filesystem through the target */
+        if (snprintf(path, sizeof(path), "/proc/%ld/root%s", pid, sibling)
+                >= (int)sizeof(path) || stat(path, &st) < 0)
+            return -1;
+        out->dev = st.st_dev;
+    }
+
+    m = mnt_devpts(ns, out->dev, sibling);
+    snprintf(out->ns, sizeof(out->ns), "%s", m ? m->point : sibling);
+
+    hm = mnt_devpts(host, out->dev, "/dev/pts");
+    if (hm) {
+        snprintf(out->host, sizeof(out->host), "%s", hm->point);
+    } else if (snprintf(out->host, sizeof(out->host), "/proc/%ld/root%s",
+                        pid, out->ns) >= (int)sizeof(out->host)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* mount point -> node path, in place */
+static void node_path(char *point, size_t size, int pts) {
+    size_t len = strcmp(point, "/") ? strlen(point) : 0;
+
+    snprintf(point + len, size - len, "/%d", pts);
+}
+
+int ptsname_paths(struct ptsname_entry const *entries, int num_entries,
+                  struct ptsname_path *paths) {
+    struct mnt_table host, ns = { 0 };
+    char path[64];
+    long ns_pid = -1;
+    int ret = 0;
+
+    if (mnt_table_load("/proc/self/mountinfo", &host) < 0) {
+        perror("/proc/self/mountinfo");
+        return -1;
+    }
+
+    for (int i = 0; i < num_entries; i++) {
+        struct ptsname_entry const *e = &entries[i];
+        struct ptsname_path *p = &paths[i];
+        /* entries come grouped by pid: parse each mountinfo once */
+        if (e->pid != ns_pid) {
+            mnt_table_free(&ns);
+            snprintf(path, sizeof(path), "/proc/%ld/mountinfo", e->pid);
+            mnt_table_load(path, &ns);
+            ns_pid = e->pid;
+        }
+
+        if (resolve_devpts(e->pid, e->tid, e->fd, &ns, &host, p) < 0) {
+            debug("no devpts found for pid %ld fd %d", e->pid, e->fd);
+            p->dev = 0;
+            snprintf(p->ns, sizeof(p->ns), "/dev/pts");
+            snprintf(p->host, sizeof(p->host), "/dev/pts");
+            ret = -1;
+        }
+
+        /* the mount point strings become full node paths */
+        node_path(p->ns, sizeof(p->ns), e->pts);
+        node_path(p->host, sizeof(p->host), e->pts);
+    }
+
+    mnt_table_free(&ns);
+    mnt_table_free(&host);
+
+    return ret;
+}
+
+/*
+ * Append the pids of cgroup and of every cgroup below it. On v2 a process
+ * sits in exactly one cgroup of the tree, so a unit's processes are spread
+ * over its whole subtree rather than listed at its top.
+ */
+static int cgroup_pids(char const *cgroup, long **pids, int *num_pids,
+                       int *max_pids) {
+    char path[PATH_MAX], buf[4096];
+    struct dirent *de;
+    size_t have = 0;
+    ssize_t n;
+    DIR *dir;
+    int fd;
+    int ret = 0;
+
+    if (snprintf(path, sizeof(path), "%s/cgroup.procs", cgroup)
+            >= (int)sizeof(path)) {
+        fprintf(stderr, "%s - path too long: %s\n", __FUNCTION__, cgroup);
+        return -1;
+    }
+    /* ENOENT is left to the caller: subgroups vanish while we walk */
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            perror(path);
+        return -1;
+    }
+
+    /* one pid per line; a line cut by the buffer's end is carried over */
+    while ((n = read(fd, buf + have, sizeof(buf) - 1 - have)) > 0
+           || (n < 0 && errno == EINTR)) {
+        char *p, *end, *nl;
+
+        if (n < 0)
+            continue;
+        have += n;
+        buf[have] = '\0';
+        for (p = buf; (nl = strchr(p, '\n')); p = nl + 1) {
+            long pid = strtol(p, &end, 10);
+
+            if (end == p || pid <= 0)
+                continue;
+            if (*num_pids == *max_pids) {
+                long *more;
+
+                *max_pids = *max_pids ? 2 * *max_pids : 1024;
+                more = realloc(*pids, *max_pids * sizeof(**pids));
+                if (!more) {
+                    close(fd);
+                    return -1;
+                }
+                *pids = more;
+            }
+            (*pids)[(*num_pids)++] = pid;
+        }
+        have = buf + have - p;
+        memmove(buf, p, have);
+    }
+    close(fd);
+
+    dir = opendir(cgroup);
+    if (!dir) {
+        if (errno != ENOENT)
+            perror(cgroup);
+        return -1;
+    }
+    while (ret == 0 && (de = readdir(dir))) {
+        if (de->d_type != DT_DIR || de->d_name[0] == '.')
+            continue;
+        if (snprintf(path, sizeof(path), "%s/%s", cgroup, de->d_name)
+                >= (int)sizeof(path))
+            continue;
+        /* a transient scope that ended since readdir() had no processes */
+        if (cgroup_pids(path, pids, num_pids, max_pids) < 0
+            && errno != ENOENT)
+            ret = -1;
+    }
+    closedir(dir);
+
+    return ret;
+}
+
+int ptsname_list_cgroup(char const *cgroup, struct ptsname_entry **entries,
+                        int *num_entries) {
+    long *pids = NULL;
+    int num_pids = 0, max_pids = 0;
+    int ret;
+
+    if (cgroup_pids(cgroup, &pids, &num_pids, &max_pids) < 0) {
+        if (errno == ENOENT)
+            perror(cgroup);
+        free(pids);
+        return -1;
+    }
+
+    debug("%d processes in %s and below", num_pids, cgroup);
+
+    ret = ptsname_list_pids(pids, num_pids, entries, num_entries);
+    free(pids);
+
+    return ret;
+}
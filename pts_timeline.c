@@ -0,0 +1,731 @@
+/*
+ * Copyright 2013
+ *  Steven Maresca <steve@zentific.com>
+ *  Zentific LLC
+ *
+ * pts_timeline:
+ *  Who held which pty, and when.
+ *
+ *  The recorder rescans the host at an interval and appends an ALLOC
+ *  record for each master that appeared and a RELEASE record for each one
+ *  that went away. Records are fixed size and go to segment files,
+ *  $DIR/seg-$USEC.rec, named after their first timestamp. A segment opens
+ *  with a HELD record for everything held at that moment, so any point in
+ *  time is answered from one segment alone. Sealed segments get a
+ *  $DIR/seg-$USEC.idx beside them that sorts the records by (pts, time).
+ *
+ *  A lookup then costs a binary search over segment names, another over
+ *  the index, and a walk over the few events of that one pty. The open
+ *  segment has no index yet and is scanned, which is bounded by its size.
+ *
+ *  A tick whose scan failed is skipped, and a master missing from a scan
+ *  is only released once its fd is seen to be gone: a scan that could not
+ *  read some table must not turn into a burst of RELEASE and ALLOC pairs.
+ */
+
+#define _GNU_SOURCE             /* usleep() */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+
+#include <linux/major.h>
+
+#include "ptmx_resolve.h"
+
+#define SEG_RECORDS 65536       /* records per segment before it is sealed */
+#define IDX_MAGIC   0x32444950u /* "PID2": records with devpts identity */
+
+struct idx_header {
+    uint32_t magic;
+    uint32_t count;
+};
+
+/* one per record, sorted by (pts, ts, rec) */
+struct idx_entry {
+    int32_t pts;
+    uint32_t rec;
+    uint64_t ts;
+};
+
+struct timeline {
+    char dir[PATH_MAX];
+    int fd;                     /* open segment */
+    char path[PATH_MAX];
+    uint32_t num_records;
+};
+
+static volatile sig_atomic_t record_stop = 0;
+
+static void record_sighandler(int sig) {
+    (void)sig;
+    record_stop = 1;
+}
+
+static uint64_t wall_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* FNV-1a of the executable path: stable across runs, cheap to compare */
+static uint64_t exe_hash(long pid) {
+    char path[64], exe[PATH_MAX];
+    uint64_t h = 0xcbf29ce484222325ull;
+    ssize_t n;
+
+    snprintf(path, sizeof(path), "/proc/%ld/exe", pid);
+    n = readlink(path, exe, sizeof(exe));
+    for (ssize_t i = 0; i < n; i++) {
+        h ^= (unsigned char)exe[i];
+        h *= 0x100000001b3ull;
+    }
+
+    return n > 0 ? h : 0;
+}
+
+/* records sort by (pid, start_time, fd, pts, dev); prefixes of it below */
+static int fd_cmp(const void *a, const void *b) {
+    struct pts_record const *ra = a, *rb = b;
+
+    if (ra->pid != rb->pid)
+        return ra->pid < rb->pid ? -1 : 1;
+    if (ra->start_time != rb->start_time)
+        return ra->start_time < rb->start_time ? -1 : 1;
+
+    return (ra->fd > rb->fd) - (ra->fd < rb->fd);
+}
+
+static int key_cmp(const void *a, const void *b) {
+    struct pts_record const *ra = a, *rb = b;
+    int c = fd_cmp(a, b);
+
+    return c ? c : (ra->pts > rb->pts) - (ra->pts < rb->pts);
+}
+
+static int record_cmp(const void *a, const void *b) {
+    struct pts_record const *ra = a, *rb = b;
+    int c = key_cmp(a, b);
+
+    return c ? c : (ra->dev > rb->dev) - (ra->dev < rb->dev);
+}
+
+static int idx_cmp(const void *a, const void *b) {
+    struct idx_entry const *ia = a, *ib = b;
+
+    if (ia->pts != ib->pts)
+        return ia->pts < ib->pts ? -1 : 1;
+    if (ia->ts != ib->ts)
+        return ia->ts < ib->ts ? -1 : 1;
+
+    return (ia->rec > ib->rec) - (ia->rec < ib->rec);
+}
+
+/* write all of buf or fail */
+static int write_all(int fd, void const *buf, size_t len) {
+    char const *p = buf;
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* build seg-$USEC.idx for a finished seg-$USEC.rec */
+static int segment_seal(char const *log_path) {
+    struct pts_record *recs;
+    struct idx_entry *idx;
+    struct idx_header hdr;
+    char idx_path[PATH_MAX], tmp_path[PATH_MAX];
+    struct stat st;
+    size_t len;
+    int fd, out, ret = -1;
+
+    len = strlen(log_path);
+    if (len < 4 || len >= sizeof(idx_path))
+        return -1;
+    snprintf(idx_path, sizeof(idx_path), "%.*s.idx", (int)len - 4, log_path);
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", idx_path)
+        >= (int)sizeof(tmp_path))
+        return -1;
+
+    fd = open(log_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(log_path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    hdr.magic = IDX_MAGIC;
+    hdr.count = st.st_size / sizeof(*recs);
+    if (hdr.count == 0) {
+        close(fd);
+        return 0;
+    }
+
+    recs = mmap(NULL, hdr.count * sizeof(*recs), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (recs == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    idx = malloc(hdr.count * sizeof(*idx));
+    if (!idx)
+        goto wrap_up;
+    for (uint32_t i = 0; i < hdr.count; i++) {
+        idx[i].pts = recs[i].pts;
+        idx[i].rec = i;
+        idx[i].ts = recs[i].ts;
+    }
+    qsort(idx, hdr.count, sizeof(*idx), idx_cmp);
+
+    /* readers only ever see a complete index */
+    out = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0) {
+        perror(tmp_path);
+        goto wrap_up;
+    }
+    if (write_all(out, &hdr, sizeof(hdr)) < 0
+        || write_all(out, idx, hdr.count * sizeof(*idx)) < 0
+        || fsync(out) < 0) {
+        perror(tmp_path);
+        close(out);
+        unlink(tmp_path);
+        goto wrap_up;
+    }
+    close(out);
+
+    if (rename(tmp_path, idx_path) < 0) {
+        perror(idx_path);
+        unlink(tmp_path);
+        goto wrap_up;
+    }
+    debug("sealed %s: %u records", log_path, hdr.count);
+    ret = 0;
+
+wrap_up:
+    free(idx);
+    munmap(recs, hdr.count * sizeof(*recs));
+
+    return ret;
+}
+
+static int is_segment(const struct dirent *de) {
+    size_t len = strlen(de->d_name);
+
+    return !strncmp(de->d_name, "seg-", 4) && len > 8
+        && !strcmp(de->d_name + len - 4, ".rec");
+}
+
+/* segment names, oldest first; zero-padded so name order is time order */
+static int segment_list(char const *dir, struct dirent ***list) {
+    int n = scandir(dir, list, is_segment, alphasort);
+
+    if (n < 0)
+        perror(dir);
+
+    return n;
+}
+
+static int timeline_open(struct timeline *tl, char const *dir) {
+    struct dirent **list;
+    char path[PATH_MAX], idx_path[PATH_MAX];
+    int n;
+
+    memset(tl, 0, sizeof(*tl));
+    tl->fd = -1;
+    snprintf(tl->dir, sizeof(tl->dir), "%s", dir);
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+
+    /* a segment left open by a previous run is sealed as it stands */
+    n = segment_list(dir, &list);
+    if (n < 0)
+        return -1;
+    for (int i = 0; i < n; i++) {
+        struct stat st;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, list[i]->d_name);
+        snprintf(idx_path, sizeof(idx_path), "%.*s.idx",
+                 (int)strlen(path) - 4, path);
+        if (stat(idx_path, &st) < 0)
+            segment_seal(path);
+        free(list[i]);
+    }
+    free(list);
+
+    return 0;
+}
+
+/* start a new segment, opening with what is held at the moment */
+static int timeline_rotate(struct timeline *tl, struct pts_record const *held,
+                           int num_held, uint64_t now) {
+    struct pts_record *snap;
+
+    if (tl->fd >= 0) {
+        close(tl->fd);
+        segment_seal(tl->path);
+    }
+
+    if (snprintf(tl->path, sizeof(tl->path), "%s/seg-%020llu.rec", tl->dir,
+                 (unsigned long long)now) >= (int)sizeof(tl->path)) {
+        fprintf(stderr, "%s - path too long in %s\n", __FUNCTION__, tl->dir);
+        return -1;
+    }
+    tl->fd = open(tl->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (tl->fd < 0) {
+        perror(tl->path);
+        return -1;
+    }
+    tl->num_records = 0;
+
+    snap = malloc((num_held ? num_held : 1) * sizeof(*snap));
+    if (!snap)
+        return -1;
+    for (int i = 0; i < num_held; i++) {
+        snap[i] = held[i];
+        snap[i].ts = now;
+        snap[i].event = PTS_HELD;
+    }
+    if (write_all(tl->fd, snap, num_held * sizeof(*snap)) < 0) {
+        perror(tl->path);
+        free(snap);
+        return -1;
+    }
+    tl->num_records += num_held;
+    free(snap);
+
+    debug("new segment %s", tl->path);
+
+    return 0;
+}
+
+/*
+ * Is the master of r still open? A scan can miss it (a table it could not
+ * read) without it being gone. Where the kernel names the pty of a master,
+ * a reopen under the same fd shows as well.
+ */
+static int record_held(struct pts_record const *r) {
+    unsigned long long start_time;
+    char path[64];
+    struct stat st;
+    int pts;
+
+    if (ptsname_start_time(r->pid, &start_time) < 0
+        || start_time != r->start_time)
+        return 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/fd/%d", r->pid, r->tid,
+             r->fd);
+    if (stat(path, &st) < 0 || !S_ISCHR(st.st_mode)
+        || major(st.st_rdev) != TTYAUX_MAJOR || minor(st.st_rdev) != 2)
+        return 0;
+
+    return ptsname_fdinfo(r->pid, r->tid, r->fd, &pts) < 0 || pts == r->pts;
+}
+
+/*
+ * The devpts instance of each record: carried over from prev where the
+ * same master was seen before, looked up once (a mountinfo parse per
+ * process) where it is new.
+ */
+static int snapshot_devs(struct pts_record *recs, int n,
+                         struct pts_record const *prev, int num_prev) {
+    struct ptsname_entry *need;
+    struct ptsname_path *paths;
+    int *at, num_need = 0;
+
+    need = malloc((n ? n : 1) * sizeof(*need));
+    at = malloc((n ? n : 1) * sizeof(*at));
+    if (!need || !at) {
+        free(need);
+        free(at);
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        struct pts_record const *p;
+
+        p = bsearch(&recs[i], prev, num_prev, sizeof(*prev), key_cmp);
+        if (p) {
+            recs[i].dev = p->dev;
+            continue;
+        }
+        memset(&need[num_need], 0, sizeof(need[num_need]));
+        need[num_need].pid = recs[i].pid;
+        need[num_need].tid = recs[i].tid;
+        need[num_need].fd = recs[i].fd;
+        need[num_need].pts = recs[i].pts;
+        at[num_need++] = i;
+    }
+
+    paths = num_need ? malloc(num_need * sizeof(*paths)) : NULL;
+    if (num_need && !paths) {
+        free(need);
+        free(at);
+        return -1;
+    }
+    /* 0 where unknown: --who takes that as any instance */
+    if (num_need)
+        ptsname_paths(need, num_need, paths);
+    for (int i = 0; i < num_need; i++)
+        recs[at[i]].dev = paths[i].dev;
+
+    free(paths);
+    free(need);
+    free(at);
+
+    return 0;
+}
+
+/*
+ * The current allocations as records, sorted and free of duplicates.
+ * -1 if the host could not be scanned at all; the caller skips the tick.
+ */
+static int timeline_snapshot(struct ptsname_budget const *cfg,
+                             struct pts_record const *prev, int num_prev,
+                             struct pts_record **out, int *num_out) {
+    struct ptsname_entry *entries = NULL;
+    struct pts_record *recs;
+    unsigned long long start_time = 0;
+    uint64_t hash = 0;
+    long last_pid = -1;
+    int num_entries = 0, n = 0, num_recs;
+
+    /* -1 alone means nothing was found; without entries, no scan at all */
+    if (ptsname_list_host(cfg, &entries, &num_entries) < 0 && !entries) {
+        fprintf(stderr, "%s - host scan failed, tick skipped\n", __FUNCTION__);
+        return -1;
+    }
+
+    recs = malloc((num_entries + num_prev + 1) * sizeof(*recs));
+    if (!recs) {
+        free(entries);
+        return -1;
+    }
+
+    /* entries come sorted by pid: one stat and one readlink per process */
+    for (int i = 0; i < num_entries; i++) {
+        struct ptsname_entry *e = &entries[i];
+
+        if (e->pid != last_pid) {
+            last_pid = e->pid;
+            if (ptsname_start_time(e->pid, &start_time) < 0)
+                start_time = 0;
+            hash = exe_hash(e->pid);
+        }
+
+        memset(&recs[n], 0, sizeof(recs[n]));
+        recs[n].pid = e->pid;
+        recs[n].tid = e->tid;
+        recs[n].fd = e->fd;
+        recs[n].pts = e->pts;
+        recs[n].start_time = start_time;
+        recs[n].exe_hash = hash;
+        n++;
+    }
+    free(entries);
+
+    if (snapshot_devs(recs, n, prev, num_prev) < 0) {
+        free(recs);
+        return -1;
+    }
+
+    /* threads with their own tables can report one master twice */
+    qsort(recs, n, sizeof(*recs), record_cmp);
+    if (n > 1) {
+        int j = 0;
+
+        for (int i = 1; i < n; i++) {
+            if (record_cmp(&recs[i], &recs[j]))
+                recs[++j] = recs[i];
+        }
+        n = j + 1;
+    }
+
+    /* masters the scan missed but that are still open stay held */
+    num_recs = n;
+    for (int i = 0; i < num_prev; i++) {
+        if (bsearch(&prev[i], recs, num_recs, sizeof(*recs), fd_cmp))
+            continue;
+        if (record_held(&prev[i])) {
+            debug("pid %d fd %d missed by the scan, still held",
+                  prev[i].pid, prev[i].fd);
+            recs[n++] = prev[i];
+        }
+    }
+    if (n > num_recs)
+        qsort(recs, n, sizeof(*recs), record_cmp);
+
+    *out = recs;
+    *num_out = n;
+
+    return 0;
+}
+
+int ptmx_record(char const *dir, long interval_usec,
+                struct ptsname_budget const *cfg) {
+    struct pts_record *prev = NULL, *cur = NULL, *events = NULL;
+    int num_prev = 0, num_cur = 0;
+    struct timeline tl;
+    struct sigaction sa;
+    int ret = -1;
+
+    if (timeline_open(&tl, dir) < 0)
+        return -1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = record_sighandler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    while (!record_stop) {
+        uint64_t now;
+        int num_events = 0;
+        int i = 0, j = 0;
+
+        if (timeline_snapshot(cfg, prev, num_prev, &cur, &num_cur) < 0) {
+            /* nothing known this tick: better no events than false ones */
+            if (!record_stop)
+                usleep(interval_usec);
+            continue;
+        }
+        now = wall_usec();
+
+        if (tl.fd < 0 || tl.num_records >= SEG_RECORDS) {
+            if (timeline_rotate(&tl, cur, num_cur, now) < 0)
+                goto wrap_up;
+        } else {
+            /* both sides sorted: one merge pass yields the differences */
+            events = malloc((num_prev + num_cur + 1) * sizeof(*events));
+            if (!events)
+                goto wrap_up;
+
+            while (i < num_prev || j < num_cur) {
+                int c = i == num_prev ? 1 : j == num_cur ? -1
+                      : record_cmp(&prev[i], &cur[j]);
+
+                if (c < 0) {
+                    events[num_events] = prev[i++];
+                    events[num_events].event = PTS_RELEASE;
+                } else if (c > 0) {
+                    events[num_events] = cur[j++];
+                    events[num_events].event = PTS_ALLOC;
+                } else {
+                    i++;
+                    j++;
+                    continue;
+                }
+                events[num_events++].ts = now;
+            }
+
+            if (num_events
+                && write_all(tl.fd, events, num_events * sizeof(*events)) < 0) {
+                perror(tl.path);
+                goto wrap_up;
+            }
+            tl.num_records += num_events;
+            free(events);
+            events = NULL;
+        }
+
+        free(prev);
+        prev = cur;
+        num_prev = num_cur;
+        cur = NULL;
+
+        if (!record_stop)
+            usleep(interval_usec);
+    }
+
+    ret = 0;
+
+wrap_up:
+    if (tl.fd >= 0) {
+        close(tl.fd);
+        segment_seal(tl.path);
+    }
+    free(prev);
+    free(cur);
+    free(events);
+
+    return ret;
+}
+
+/* first index entry at or after (pts, ts) */
+static uint32_t idx_lower(struct idx_entry const *idx, uint32_t count,
+                          int pts, uint64_t ts) {
+    uint32_t lo = 0, hi = count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (idx[mid].pts < pts || (idx[mid].pts == pts && idx[mid].ts < ts))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* pts numbers repeat across devpts instances; 0 on either side is any */
+static int same_instance(struct pts_record const *r, uint64_t dev) {
+    return !dev || !r->dev || r->dev == dev;
+}
+
+/* apply one record to the owner set being replayed */
+static int owners_apply(struct pts_record const *r, struct pts_record **owners,
+                        int *num, int *max) {
+    for (int i = 0; i < *num; i++) {
+        if (!record_cmp(r, &(*owners)[i])) {
+            if (r->event == PTS_RELEASE)
+                (*owners)[i] = (*owners)[--*num];
+            return 0;
+        }
+    }
+    if (r->event == PTS_RELEASE)
+        return 0;
+
+    if (*num == *max) {
+        struct pts_record *tmp;
+
+        *max = *max ? 2 * *max : 8;
+        tmp = realloc(*owners, *max * sizeof(*tmp));
+        if (!tmp)
+            return -1;
+        *owners = tmp;
+    }
+    (*owners)[(*num)++] = *r;
+
+    return 0;
+}
+
+int ptsname_timeline_who(char const *dir, uint64_t dev, int pts, uint64_t when,
+                         struct pts_record **owners, int *num_owners) {
+    struct dirent **list;
+    struct pts_record *recs = MAP_FAILED;
+    struct idx_header *hdr = MAP_FAILED;
+    char path[PATH_MAX];
+    struct stat st, ist;
+    size_t recs_len = 0, idx_len = 0;
+    int max_owners = 0;
+    int n, seg = -1, fd, ret = -1;
+    uint32_t count;
+
+    *owners = NULL;
+    *num_owners = 0;
+
+    n = segment_list(dir, &list);
+    if (n < 0)
+        return -1;
+
+    /* the last segment that had already started by then */
+    for (int lo = 0, hi = n; lo < hi; ) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (strtoull(list[mid]->d_name + 4, NULL, 10) <= when) {
+            seg = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (seg < 0) {
+        fprintf(stderr, "%s - nothing recorded that early in %s\n",
+                __FUNCTION__, dir);
+        goto wrap_up;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", dir, list[seg]->d_name);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        goto wrap_up;
+    }
+    count = st.st_size / sizeof(*recs);
+    recs_len = count * sizeof(*recs);
+    if (count)
+        recs = mmap(NULL, recs_len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (count && recs == MAP_FAILED) {
+        perror("mmap");
+        goto wrap_up;
+    }
+
+    snprintf(path + strlen(path) - 4, 5, ".idx");
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && fstat(fd, &ist) == 0 && ist.st_size >= (off_t)sizeof(*hdr)) {
+        idx_len = ist.st_size;
+        hdr = mmap(NULL, idx_len, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (fd >= 0)
+        close(fd);
+
+    if (hdr != MAP_FAILED && hdr->magic == IDX_MAGIC && hdr->count == count
+        && idx_len >= sizeof(*hdr) + count * sizeof(struct idx_entry)) {
+        struct idx_entry const *idx = (struct idx_entry const *)(hdr + 1);
+        uint32_t i = idx_lower(idx, count, pts, 0);
+
+        /* sealed: replay only this pty's events, in time order */
+        for (; i < count && idx[i].pts == pts && idx[i].ts <= when; i++) {
+            if (same_instance(&recs[idx[i].rec], dev)
+                && owners_apply(&recs[idx[i].rec], owners, num_owners,
+                                &max_owners) < 0)
+                goto wrap_up;
+        }
+    } else {
+        /* still being written: records are in time order already */
+        for (uint32_t i = 0; i < count && recs[i].ts <= when; i++) {
+            if (recs[i].pts == pts && same_instance(&recs[i], dev)
+                && owners_apply(&recs[i], owners, num_owners, &max_owners) < 0)
+                goto wrap_up;
+        }
+    }
+    ret = 0;
+
+wrap_up:
+    if (recs != MAP_FAILED)
+        munmap(recs, recs_len);
+    if (hdr != MAP_FAILED)
+        munmap(hdr, idx_len);
+    for (int i = 0; i < n; i++)
+        free(list[i]);
+    free(list);
+    if (ret < 0) {
+        free(*owners);
+        *owners = NULL;
+        *num_owners = 0;
+    }
+
+    return ret;
+}
@@ -11,149 +11,1132 @@
  *  Copyright (c) 2008-2010 Pascal Terjan <pterjan@linuxfr.org>
 */
 
-#define _XOPEN_SOURCE 500       /* getsid() */
+#define _GNU_SOURCE             /* getsid(), syscall() */
 
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/wait.h>
 
 #include <limits.h>
 
+#include <linux/kcmp.h>
 #include <linux/kdev_t.h>
 #include <linux/major.h>
 
 #include "ptmx_resolve.h"
 #include "mytrace.h"
 
-#define MAX_PTYS 4096
-/* this should be reasonable for most realistic scenarios 
- *  and is the kernel default
- *  https://lkml.org/lkml/2012/1/2/151
+/*
+ * A master is whatever resolves to the ptmx character device, whether it was
+ * opened as /dev/ptmx or /dev/pts/ptmx (containers, multi-instance devpts).
  */
-int ptsname_list_all(long pid, int **pts_ids, int *num_ids) {
-    char fdstr[1024];
-    struct mytrace *parent, *child;
-    int fd = 0;
-    int ret = -1;
-    struct stat stat_buf;
-    DIR *fddir;
-    struct dirent *fddirent;
+static int is_ptmx(char const *fdpath, struct statx *stx) {
+    if (statx(AT_FDCWD, fdpath, 0, STATX_TYPE | STATX_INO, stx) < 0)
+        return 0;
 
-    if(!pts_ids || !num_ids){
-        fprintf(stderr, "%s - invalid params: pts_ids & num_ids must not be"
-                " NULL\n", __FUNCTION__);
+    return S_ISCHR(stx->stx_mode)
+        && stx->stx_rdev_major == TTYAUX_MAJOR && stx->stx_rdev_minor == 2;
+}
+
+/*
+ * Newer kernels name the pty of a master in its fdinfo ("tty-index:"),
+ * which costs one read and touches the target not at all. The same read
+ * gives mnt_id, part of the fd's generation. -1 in *pts_id if absent.
+ */
+static int fdinfo_ids(long pid, long tid, int fd, int *pts_id, int *mnt_id) {
+    char path[64], buf[512];
+    ssize_t n;
+    int f;
+
+    snprintf(path, sizeof(path), "/proc/%ld/task/%ld/fdinfo/%d", pid, tid, fd);
+    f = open(path, O_RDONLY | O_CLOEXEC);
+    if (f < 0)
+        return -1;
+    n = read(f, buf, sizeof(buf));
+    close(f);
+    if (n <= 0)
         return -1;
-    }
 
-    parent = mytrace_attach(pid);
-    if (!parent) {
-        fprintf(stderr, "%s - cannot access process %ld\n", __FUNCTION__, pid);
+    *pts_id = proc_key_num(buf, n, "tty-index:");
+    *mnt_id = proc_key_num(buf, n, "mnt_id:");
+
+    return 0;
+}
+
+int ptsname_fdinfo(long pid, long tid, int fd, int *pts_id) {
+    int pts, mnt_id;
+
+    if (fdinfo_ids(pid, tid, fd, &pts, &mnt_id) < 0 || pts < 0)
         return -1;
+    *pts_id = pts;
+
+    return 0;
+}
+
+static void fd_gen(struct statx const *stx, unsigned long long start_time,
+                   int mnt_id, struct ptsname_gen *gen) {
+    gen->start_time = start_time;
+    gen->dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    gen->ino = stx->stx_ino;
+    gen->mnt_id = mnt_id;
+    ptsname_gen_now(gen);
+}
+
+/* 0 if both tasks share one fd table, >0 if not, -1 (errno) on failure */
+static int cmp_fd_table(long tid_a, long tid_b) {
+    return syscall(SYS_kcmp, tid_a, tid_b, KCMP_FILES, 0, 0);
+}
+
+/*
+ * Threads created without CLONE_FILES have a private fd table, visible only
+ * under /proc/$PID/task/$TID/fd. Return one owning tid per distinct table;
+ * threads sharing a table are collapsed with kcmp(KCMP_FILES).
+ */
+static int list_fd_tables(long pid, long *owners, int max_owners) {
+    char taskstr[64];
+    struct proc_dir taskdir;
+    char const *name;
+    int num_owners = 0;
+    int i;
+
+    snprintf(taskstr, sizeof(taskstr), "/proc/%ld/task", pid);
+    if (proc_dir_open(&taskdir, taskstr) < 0) {
+        owners[0] = pid;
+        return 1;
+    }
+
+    /* the leader goes first so the common case attaches to it, as before */
+    owners[num_owners++] = pid;
+
+    while ((name = proc_dir_next(&taskdir)) && num_owners < max_owners) {
+        long tid = strtol(name, NULL, 10);
+
+        if (tid <= 0 || tid == pid)
+            continue;
+
+        int cmp = 1;
+        for (i = 0; i < num_owners; i++) {
+            cmp = cmp_fd_table(owners[i], tid);
+            if (cmp <= 0)
+                break;
+        }
+
+        if (cmp < 0 && (errno == ENOSYS || errno == EPERM)) {
+            /* no kcmp: assume CLONE_FILES, i.e. the old leader-only scan */
+            debug("kcmp unavailable (%s), scanning leader only",
+                  strerror(errno));
+            num_owners = 1;
+            break;
+        }
+
+        /* shared with a known owner, or the thread already exited */
+        if (cmp <= 0)
+            continue;
+
+        debug("tid %ld of pid %ld has its own fd table", tid, pid);
+        owners[num_owners++] = tid;
+    }
+    proc_dir_close(&taskdir);
+
+    return num_owners;
+}
+
+/* one ptmx fd, as seen in one fd table */
+struct pts_candidate {
+    long pid;
+    long tid;           /* owner of the fd table the fd lives in */
+    int fd;
+    dev_t dev;          /* ptmx inode, a cheap prefilter for kcmp */
+    ino_t ino;
+    int rep;            /* candidate resolved on behalf of this one */
+    int tried;
+    int pts;
+    int cacheable;      /* gen is filled in */
+    struct ptsname_gen gen;
+};
+
+/*
+ * With an arena the candidates grow in place at its top until the first
+ * scratch allocation, which seals them; without one they are realloc()ed
+ * and scratch is malloc()ed as usual. An arena also keeps the program
+ * probes (app_probe.c) out: they fork, and need buffers of their own.
+ */
+struct pts_candidates {
+    struct pts_candidate *c;
+    int num, max;
+    struct ptsname_arena *arena;
+    int sealed;
+    int unreadable;             /* errno of a table that was skipped */
+};
+
+static void *arena_top(struct ptsname_arena *a, size_t *avail) {
+    size_t at = (a->used + 15) & ~(size_t)15;
+
+    *avail = at < a->size ? a->size - at : 0;
+
+    return (char *)a->base + at;
+}
+
+static void *cs_alloc(struct pts_candidates *cs, size_t size) {
+    struct ptsname_arena *a = cs->arena;
+    size_t avail;
+    void *p;
+
+    if (!a)
+        return malloc(size);
+
+    if (!cs->sealed) {
+        if (cs->c)
+            a->used = (char *)(cs->c + cs->num) - (char *)a->base;
+        cs->max = cs->num;
+        cs->sealed = 1;
+    }
+    p = arena_top(a, &avail);
+    if (avail < size) {
+        errno = ENOMEM;
+        return NULL;
     }
+    a->used = (char *)p + size - (char *)a->base;
 
-    child = mytrace_fork(parent);
+    return p;
+}
 
-    *pts_ids = calloc(MAX_PTYS, sizeof(int));
+/* scratch from cs_alloc(), and everything allocated after it */
+static void cs_free(struct pts_candidates *cs, void *p) {
+    if (!cs->arena)
+        free(p);
+    else if (p)
+        cs->arena->used = (char *)p - (char *)cs->arena->base;
+}
 
-    snprintf(fdstr, sizeof(fdstr), "/proc/%ld/fd", pid);
-    fddir = opendir(fdstr);
+static struct pts_candidate *candidate_add(struct pts_candidates *cs) {
+    if (cs->num == cs->max && cs->arena) {
+        size_t avail;
+
+        if (cs->sealed) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        if (!cs->c)
+            cs->c = arena_top(cs->arena, &avail);
+        else
+            arena_top(cs->arena, &avail);
+        cs->max = avail / sizeof(*cs->c);
+        if (cs->num == cs->max) {
+            errno = ENOMEM;
+            return NULL;
+        }
+    } else if (cs->num == cs->max) {
+        int max = cs->max ? 2 * cs->max : 64;
+        struct pts_candidate *c = realloc(cs->c, max * sizeof(*c));
+        if (!c)
+            return NULL;
+        cs->c = c;
+        cs->max = max;
+    }
+
+    return memset(&cs->c[cs->num++], 0, sizeof(*cs->c));
+}
+
+static void candidates_free(struct pts_candidates *cs) {
+    if (!cs->arena)
+        free(cs->c);
+    cs->c = NULL;
+    cs->num = cs->max = 0;
+}
+
+/* in place, and without qsort(), which may allocate a merge buffer */
+static void candidates_sort(struct pts_candidates *cs,
+                            int (*cmp)(const void *, const void *)) {
+    struct pts_candidate tmp, *c = cs->c;
+    int n = cs->num;
+
+    for (int start = n / 2 - 1, end = n - 1; end > 0;) {
+        int root, child;
+
+        if (start >= 0) {
+            root = start--;
+        } else {
+            tmp = c[0];
+            c[0] = c[end];
+            c[end] = tmp;
+            root = 0;
+            end--;
+        }
+        /* sift c[root] down within c[0..end] */
+        while ((child = 2 * root + 1) <= end) {
+            if (child < end && cmp(&c[child], &c[child + 1]) < 0)
+                child++;
+            if (cmp(&c[root], &c[child]) >= 0)
+                break;
+            tmp = c[root];
+            c[root] = c[child];
+            c[child] = tmp;
+            root = child;
+        }
+    }
+}
+
+/*
+ * Collect the ptmx fds of the table owned by tid. -1 with ENOMEM when the
+ * candidates cannot grow; a table that cannot be read is skipped.
+ */
+static int collect_table(long pid, long tid, struct pts_candidates *cs) {
+    char fdstr[1024];
+    struct statx stx;
+    struct proc_dir fddir;
+    char const *name;
+
+    snprintf(fdstr, sizeof(fdstr), "/proc/%ld/task/%ld/fd", pid, tid);
+    if (proc_dir_open(&fddir, fdstr) < 0) {
+        cs->unreadable = errno;
+        fprintf(stderr, "%s - cannot read %s\n", __FUNCTION__, fdstr);
+        return 0;
+    }
 
     /* Look for file descriptors that are PTYs */
-    while ((fddirent = readdir(fddir)) && *num_ids < MAX_PTYS) {
-        fd = atoi(fddirent->d_name);
+    while ((name = proc_dir_next(&fddir))) {
+        struct pts_candidate *c;
+        int fd = atoi(name);
+
+        snprintf(fdstr, sizeof(fdstr), "/proc/%ld/task/%ld/fd/%s",
+                 pid, tid, name);
+
+        if (!is_ptmx(fdstr, &stx))
+            continue;
+
+        debug("found ptmx for %d for pid %li tid %li\n", fd, pid, tid);
+
+        c = candidate_add(cs);
+        if (!c) {
+            proc_dir_close(&fddir);
+            errno = ENOMEM;
+            return -1;
+        }
+        c->pid = pid;
+        c->tid = tid;
+        c->fd = fd;
+        c->dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+        c->ino = stx.stx_ino;
+        c->pts = -1;
+    }
+    proc_dir_close(&fddir);
+
+    return 0;
+}
+
+/*
+ * Order candidates so that fds referring to one open file description end
+ * up adjacent: by ptmx inode first, then by kcmp(KCMP_FILE), whose result
+ * is a stable (if obfuscated) ordering of the kernel's struct file.
+ */
+static int candidate_cmp(const void *a, const void *b) {
+    const struct pts_candidate *x = a, *y = b;
+    long r;
+
+    if (x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    if (x->ino != y->ino)
+        return x->ino < y->ino ? -1 : 1;
+
+    r = syscall(SYS_kcmp, x->tid, y->tid, KCMP_FILE, x->fd, y->fd);
+    if (r == 0)
+        return 0;
+    if (r == 1 || r == 2)
+        return r == 1 ? -1 : 1;
+
+    /* no ordering available: never merge, keep the order deterministic */
+    if (x->tid != y->tid)
+        return x->tid < y->tid ? -1 : 1;
+    return x->fd - y->fd;
+}
+
+static int candidate_cmp_pid(const void *a, const void *b) {
+    const struct pts_candidate *x = a, *y = b;
 
-        snprintf(fdstr, sizeof(fdstr), "/proc/%ld/fd/%s", pid, fddirent->d_name);
+    if (x->pid != y->pid)
+        return x->pid < y->pid ? -1 : 1;
+    if (x->tid != y->tid)
+        return x->tid < y->tid ? -1 : 1;
+    return x->fd - y->fd;
+}
+
+static void group_candidates(struct pts_candidates *cs) {
+    int i;
+
+    candidates_sort(cs, candidate_cmp);
+
+    for (i = 0; i < cs->num; i++) {
+        struct pts_candidate *c = &cs->c[i];
+
+        c->rep = i;
+        if (i > 0 && candidate_cmp(&cs->c[i - 1], c) == 0)
+            c->rep = cs->c[i - 1].rep;
+    }
+}
+
+/*
+ * Resolve on local copies of the table's fds: no stop at all with
+ * pidfd_getfd(), one short one otherwise. -1 if the fds could not be had.
+ */
+static int resolve_table_local(long pid, long tid, struct pts_candidates *cs) {
+    int *fds, *local_fds, *idx;
+    int num_fds = 0;
+    int ret = -1;
+    int i;
 
-        if (lstat(fdstr, &stat_buf) < 0)
+    fds = cs_alloc(cs, 3 * cs->num * sizeof(int));
+    if (!fds)
+        return -1;
+    local_fds = fds + cs->num;
+    idx = local_fds + cs->num;
+
+    for (i = 0; i < cs->num; i++) {
+        struct pts_candidate *c = &cs->c[i];
+
+        if (c->rep != i || c->tid != tid || c->tried)
             continue;
+        idx[num_fds] = i;
+        fds[num_fds++] = c->fd;
+    }
 
-        char linkname[PATH_MAX+1] = {0};
-        int rlnk = readlink(fdstr, linkname, PATH_MAX);
-        linkname[PATH_MAX-1] = '\0';
+    if (ptsname_grab_fds(pid, tid, fds, num_fds, local_fds) == 0) {
+        for (i = 0; i < num_fds; i++) {
+            struct pts_candidate *c = &cs->c[idx[i]];
+            int pts_number = -1;
 
-        //if (!S_ISCHR(stat_buf.st_mode)
-        //    || MAJOR(stat_buf.st_rdev) != UNIX98_PTY_SLAVE_MAJOR)
-        //    continue;
+            c->tried = 1;
+            if (local_fds[i] < 0)
+                continue;
+            if (ioctl(local_fds[i], TIOCGPTN, &pts_number) == 0)
+                c->pts = pts_number;
+            close(local_fds[i]);
+        }
+        ret = 0;
+    }
+    cs_free(cs, fds);
 
-        if(!linkname || !strstr("/dev/ptmx", linkname) || strlen(linkname) == 0) continue;
+    return ret;
+}
 
-        debug("found %s for %d for pid %li\n", linkname, fd, pid);
+/* Resolve the representative of every group living in the table of tid */
+static int resolve_table(long pid, long tid, struct pts_candidates *cs) {
+    struct mytrace trace;
+    int ret = -1;
+    int i;
 
+    if (resolve_table_local(pid, tid, cs) == 0)
+        return 0;
+
+    /* last resort: inject the ioctl itself. TIOCGPTN only reads, and the
+     * thread's registers and stack are put back, so no child is forked */
+    if (mytrace_attach(&trace, tid) < 0) {
+        fprintf(stderr, "%s - cannot access process %ld\n", __FUNCTION__, tid);
+        return -1;
+    }
+
+    for (i = 0; i < cs->num; i++) {
+        struct pts_candidate *c = &cs->c[i];
         int pts_number = -1;
-        ret = mytrace_TIOCGPTN(child, fd, &pts_number);
+
+        if (c->rep != i || c->tid != tid || c->tried)
+            continue;
+
+        c->tried = 1;
+        ret = mytrace_TIOCGPTN(&trace, c->fd, &pts_number);
         if (ret < 0) {
             perror("mytrace_TIOCGPTN");
         } else {
-            (*pts_ids)[*num_ids] = pts_number;
-            *num_ids += 1;
+            c->pts = pts_number;
         }
     }
-    closedir(fddir);
 
-wrap_up:
-    mytrace_detach(parent);
-    waitpid(pid, NULL, 0);      
+    mytrace_detach(&trace);
+    waitpid(tid, NULL, 0);      
 
     return ret;
 }
 
-int ptsname_by_fd(long pid, int target_fd, int *pts_id) {
-    char fdstr[1024];
-    struct mytrace *parent, *child;
-    int ret = 0;
-    struct stat stat_buf;
-    char linkname[PATH_MAX+1] = {0};
-    int pts_number = -1;
+/* ptys taken from one program probe */
+#define PROBE_MAX_PTYS 64
 
-    parent = mytrace_attach(pid);
-    if (!parent) {
-        fprintf(stderr, "%s - cannot access process %ld\n", __FUNCTION__, pid);
+/*
+ * What the program itself says it holds (app_probe.c), trusted only as far
+ * as it agrees with the masters seen in pid's table: one pty for each
+ * group, the ones already known among them, and then only when exactly
+ * one group is left to pin to exactly one pty.
+ */
+static void probe_candidates(long pid, struct pts_candidates *cs,
+                             struct ptsname_probe_pty *ptys, int num) {
+    int groups = 0, open_rep = -1, open_groups = 0;
+    int left = 0, pts = -1;
+    int i, j;
+
+    for (i = 0; i < cs->num; i++) {
+        struct pts_candidate *c = &cs->c[i], *r = &cs->c[c->rep];
+
+        if (c->pid != pid || c->tid != pid)
+            continue;
+        /* count each group once, at its first member from pid */
+        for (j = 0; j < i; j++) {
+            if (cs->c[j].rep == c->rep && cs->c[j].pid == pid
+                && cs->c[j].tid == pid)
+                break;
+        }
+        if (j < i)
+            continue;
+        groups++;
+        if (r->tried && r->pts >= 0) {
+            for (j = 0; j < num && ptys[j].pts != r->pts; j++)
+                ;
+            if (j == num)
+                return;             /* disagrees with what we know */
+            ptys[j].pts = -1;
+        } else {
+            open_rep = c->rep;
+            open_groups++;
+        }
+    }
+
+    for (j = 0; j < num; j++) {
+        if (ptys[j].pts >= 0) {
+            pts = ptys[j].pts;
+            left++;
+        }
+    }
+    if (groups != num || open_groups != 1 || left != 1)
+        return;
+
+    debug("probe: pid %ld fd %d is pts %d", pid, cs->c[open_rep].fd, pts);
+    cs->c[open_rep].pts = pts;
+    cs->c[open_rep].tried = 1;
+}
+
+/* every group answered by fdinfo, the cache or an agent */
+static void resolve_untouched(struct pts_candidates *cs) {
+    unsigned long long start_time = 0;
+    long start_pid = -1;
+    int i;
+
+    for (i = 0; i < cs->num; i++) {
+        struct pts_candidate *c = &cs->c[i];
+        int mnt_id = -1;
+
+        if (c->rep == i && !c->tried
+            && fdinfo_ids(c->pid, c->tid, c->fd, &c->pts, &mnt_id) == 0
+            && c->pts >= 0)
+            c->tried = 1;
+
+        /* the leader's table only: a thread's own one has no start time
+         * of its own here */
+        if (c->rep == i && !c->tried && c->tid == c->pid) {
+            if (start_pid != c->pid
+                && ptsname_start_time(c->pid, &start_time) == 0)
+                start_pid = c->pid;
+            if (start_pid == c->pid) {
+                c->gen.start_time = start_time;
+                c->gen.dev = c->dev;
+                c->gen.ino = c->ino;
+                c->gen.mnt_id = mnt_id;
+                ptsname_gen_now(&c->gen);
+                c->cacheable = 1;
+                if (ptsname_cache_get(c->pid, c->fd, &c->gen, &c->pts) == 0)
+                    c->tried = 1;
+            }
+        }
+
+        /* an agent shares the leader's table and needs no stop */
+        if (c->rep == i && !c->tried && c->tid == c->pid
+            && ptmx_agent_TIOCGPTN(c->pid, c->fd, &c->pts) == 0)
+            c->tried = 1;
+    }
+}
+
+/* everything that needs no stop: fdinfo, cache, agent, the program */
+static void resolve_stop_free(struct pts_candidates *cs) {
+    struct ptsname_probe_pty *ptys;
+    int i, j;
+
+    group_candidates(cs);
+    resolve_untouched(cs);
+
+    if (cs->arena)
+        return;
+    ptys = malloc(PROBE_MAX_PTYS * sizeof(*ptys));
+    if (!ptys)
+        return;
+
+    /* then the program itself, once per process with something left */
+    for (i = 0; i < cs->num; i++) {
+        struct pts_candidate *c = &cs->c[i];
+        int num;
+
+        if (c->rep != i || c->tried || c->tid != c->pid)
+            continue;
+        for (j = 0; j < i; j++) {
+            if (cs->c[j].rep == j && cs->c[j].pid == c->pid
+                && cs->c[j].tid == c->pid)
+                break;
+        }
+        if (j < i)
+            continue;
+        num = ptsname_probe(c->pid, ptys, PROBE_MAX_PTYS, NULL);
+        if (num > 0)
+            probe_candidates(c->pid, cs, ptys, num);
+    }
+    free(ptys);
+}
+
+/* remember what was found, and hand each group's answer to its members */
+static int resolve_finish(struct pts_candidates *cs, int ret) {
+    int i;
+
+    for (i = 0; i < cs->num; i++) {
+        struct pts_candidate *c = &cs->c[i];
+
+        if (c->rep == i && c->cacheable)
+            ptsname_cache_put(c->pid, c->fd, &c->gen, c->pts);
+    }
+
+    for (i = 0; i < cs->num; i++) {
+        cs->c[i].pts = cs->c[cs->c[i].rep].pts;
+        /* answered without needing any table resolved */
+        if (cs->c[i].pts >= 0)
+            ret = 0;
+    }
+
+    return ret;
+}
+
+static int resolve_candidates(struct pts_candidates *cs) {
+    int ret = -1;
+    int i;
+
+    resolve_stop_free(cs);
+
+    /* one attach per fd table that still holds an unresolved group */
+    for (i = 0; i < cs->num; i++) {
+        struct pts_candidate *c = &cs->c[i];
+
+        if (c->rep == i && !c->tried) {
+            int r = resolve_table(c->pid, c->tid, cs);
+
+            /* a process exiting mid-scan must not hide the others' results */
+            if (r >= 0 || ret < 0)
+                ret = r;
+        }
+    }
+
+    return resolve_finish(cs, ret);
+}
+
+/* a process's distinct fd tables, beyond which threads are not searched */
+#define MAX_FD_TABLES 256
+
+/* -1 (ENOMEM) when not everything found fits */
+static int collect_pids(long const *pids, int num_pids,
+                        struct pts_candidates *cs) {
+    long owners[MAX_FD_TABLES];
+    int num_owners;
+    int i, j;
+
+    for (i = 0; i < num_pids; i++) {
+        num_owners = list_fd_tables(pids[i], owners, MAX_FD_TABLES);
+        for (j = 0; j < num_owners; j++) {
+            if (collect_table(pids[i], owners[j], cs) < 0)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* the answers in cs as entries, per process in fd order; frees cs */
+static int candidates_entries(struct pts_candidates *cs, int ret,
+                              struct ptsname_entry **entries,
+                              int *num_entries) {
+    int i;
+
+    *entries = calloc(cs->num ? cs->num : 1, sizeof(**entries));
+    if (!*entries) {
+        candidates_free(cs);
+        return -1;
+    }
+
+    candidates_sort(cs, candidate_cmp_pid);
+
+    for (i = 0; i < cs->num; i++) {
+        if (cs->c[i].pts < 0)
+            continue;
+        (*entries)[*num_entries].pid = cs->c[i].pid;
+        (*entries)[*num_entries].tid = cs->c[i].tid;
+        (*entries)[*num_entries].fd = cs->c[i].fd;
+        (*entries)[*num_entries].pts = cs->c[i].pts;
+        *num_entries += 1;
+    }
+    candidates_free(cs);
+
+    return ret;
+}
+
+int ptsname_list_pids(long const *pids, int num_pids,
+                      struct ptsname_entry **entries, int *num_entries) {
+    struct pts_candidates cs = { 0 };
+    int ret = -1;
+
+    if(!entries || !num_entries){
+        fprintf(stderr, "%s - invalid params: entries & num_entries must not"
+                " be NULL\n", __FUNCTION__);
+        return -1;
+    }
+
+    *entries = NULL;
+    *num_entries = 0;
+
+    if (collect_pids(pids, num_pids, &cs) < 0) {
+        candidates_free(&cs);
+        return -1;
+    }
+
+    if (cs.num == 0)
+        return -1;
+
+    ret = resolve_candidates(&cs);
+
+    return candidates_entries(&cs, ret, entries, num_entries);
+}
+
+struct table_job {
+    long pid, tid;
+    int cls;
+};
+
+struct table_pool {
+    pthread_mutex_t lock;
+    struct pts_candidates *cs;
+    struct table_job *jobs;
+    int num_jobs, next;
+    int ret;
+};
+
+static int table_job_cmp(const void *a, const void *b) {
+    struct table_job const *ja = a, *jb = b;
+
+    if (ja->cls != jb->cls)
+        return ja->cls - jb->cls;
+    if (ja->pid != jb->pid)
+        return ja->pid < jb->pid ? -1 : 1;
+    return (ja->tid > jb->tid) - (ja->tid < jb->tid);
+}
+
+/*
+ * Jobs are distinct fd tables, and resolve_table() only writes the
+ * candidates of its own table, so workers share cs without locking it.
+ */
+static void *table_worker(void *arg) {
+    struct table_pool *pool = arg;
+
+    for (;;) {
+        struct table_job *job;
+        int r;
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->next == pool->num_jobs) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        job = &pool->jobs[pool->next++];
+        pthread_mutex_unlock(&pool->lock);
+
+        r = resolve_table(job->pid, job->tid, pool->cs);
+
+        pthread_mutex_lock(&pool->lock);
+        if (r >= 0 || pool->ret < 0)
+            pool->ret = r;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+int ptsname_list_pids_pooled(long const *pids, int num_pids, int num_workers,
+                             struct ptsname_entry **entries,
+                             int *num_entries) {
+    struct table_pool pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .ret = -1 };
+    struct pts_candidates cs = { 0 };
+    pthread_t *workers;
+    int i, j;
+
+    *entries = NULL;
+    *num_entries = 0;
+
+    if (collect_pids(pids, num_pids, &cs) < 0) {
+        candidates_free(&cs);
+        return -1;
+    }
+    if (cs.num == 0)
+        return -1;
+
+    /* grouped across every process before anything is stopped */
+    resolve_stop_free(&cs);
+
+    pool.cs = &cs;
+    pool.jobs = malloc(cs.num * sizeof(*pool.jobs));
+    workers = calloc(num_workers > 0 ? num_workers : 1, sizeof(*workers));
+    if (!pool.jobs || !workers) {
+        free(pool.jobs);
+        free(workers);
+        candidates_free(&cs);
+        return -1;
+    }
+
+    /* one job per fd table that still holds an unresolved group */
+    for (i = 0; i < cs.num; i++) {
+        struct pts_candidate *c = &cs.c[i];
+
+        if (c->rep != i || c->tried)
+            continue;
+        for (j = 0; j < pool.num_jobs; j++) {
+            if (pool.jobs[j].tid == c->tid && pool.jobs[j].pid == c->pid)
+                break;
+        }
+        if (j < pool.num_jobs)
+            continue;
+        pool.jobs[j].pid = c->pid;
+        pool.jobs[j].tid = c->tid;
+        pool.jobs[j].cls = ptsname_class(c->pid);
+        pool.num_jobs++;
+    }
+    qsort(pool.jobs, pool.num_jobs, sizeof(*pool.jobs), table_job_cmp);
+
+    debug("%d candidates, %d fd tables left to stop", cs.num, pool.num_jobs);
+
+    for (i = 0; i < num_workers; i++) {
+        if (pthread_create(&workers[i], NULL, table_worker, &pool) != 0)
+            break;
+    }
+    num_workers = i;
+    if (num_workers == 0)
+        table_worker(&pool);
+    for (i = 0; i < num_workers; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    free(pool.jobs);
+
+    return candidates_entries(&cs, resolve_finish(&cs, pool.ret), entries,
+                              num_entries);
+}
+
+int ptsname_list_into(long pid, struct ptsname_entry *out, int max_out,
+                      struct ptsname_arena *arena) {
+    struct pts_candidates cs = { .arena = arena };
+    size_t mark;
+    int num = 0;
+    int ret;
+
+    if (!out || !arena) {
+        errno = EINVAL;
+        return -1;
+    }
+    mark = arena->used;
+
+    if (collect_pids(&pid, 1, &cs) < 0) {
+        arena->used = mark;
+        return -1;
+    }
+    /* none held, unless the table could not be looked at */
+    if (cs.num == 0) {
+        arena->used = mark;
+        if (cs.unreadable) {
+            errno = cs.unreadable;
+            return -1;
+        }
+        return 0;
+    }
+
+    ret = resolve_candidates(&cs);
+    candidates_sort(&cs, candidate_cmp_pid);
+
+    for (int i = 0; i < cs.num; i++) {
+        if (cs.c[i].pts < 0)
+            continue;
+        /* all or nothing: a partial answer would pass for a complete one */
+        if (num == max_out) {
+            arena->used = mark;
+            errno = ENOMEM;
+            return -1;
+        }
+        out[num].pid = cs.c[i].pid;
+        out[num].tid = cs.c[i].tid;
+        out[num].fd = cs.c[i].fd;
+        out[num].pts = cs.c[i].pts;
+        num++;
+    }
+    arena->used = mark;
+
+    return ret < 0 && num == 0 ? -1 : num;
+}
+
+/* ppid from /proc/$PID/stat; comm may contain anything, so skip past ')' */
+static long proc_ppid(long pid) {
+    char path[64], buf[512];
+    int const field = 4;
+    long long ppid;
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    n = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (n <= 0 || proc_stat_fields(buf, n, &field, 1, &ppid) < 0)
+        return -1;
+
+    return ppid;
+}
+
+/*
+ * Field 22 of /proc/$PID/stat. pid and start time together name a process
+ * for good: a recycled pid comes back with a later start time.
+ */
+int ptsname_start_time(long pid, unsigned long long *start_time) {
+    char path[64], buf[1024];
+    int const field = 22;
+    long long start;
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    n = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (n <= 0 || proc_stat_fields(buf, n, &field, 1, &start) < 0
+        || start < 0)
+        return -1;
+    *start_time = start;
+
+    return 0;
+}
+
+int ptsname_list_tree(long pid, struct ptsname_entry **entries,
+                      int *num_entries) {
+    long *pids = NULL, *ppids = NULL;
+    int num_pids = 0, max_pids = 0;
+    int num_tree = 1;
+    int ret;
+    DIR *procdir;
+    struct dirent *procdirent;
+    int i, j;
+
+    procdir = opendir("/proc");
+    if (!procdir) {
+        perror("/proc");
+        return -1;
+    }
+
+    while ((procdirent = readdir(procdir))) {
+        long p = strtol(procdirent->d_name, NULL, 10);
+
+        if (p <= 0)
+            continue;
+        if (num_pids == max_pids) {
+            max_pids = max_pids ? 2 * max_pids : 1024;
+            pids = realloc(pids, max_pids * sizeof(*pids));
+            ppids = realloc(ppids, max_pids * sizeof(*ppids));
+            if (!pids || !ppids) {
+                closedir(procdir);
+                free(pids);
+                free(ppids);
+                return -1;
+            }
+        }
+        pids[num_pids] = p;
+        ppids[num_pids++] = proc_ppid(p);
+    }
+    closedir(procdir);
+
+    /* move the tree rooted at pid to the front, breadth first */
+    for (i = 0; i < num_pids; i++) {
+        if (pids[i] == pid) {
+            pids[i] = pids[0];
+            ppids[i] = ppids[0];
+            pids[0] = pid;
+            break;
+        }
+    }
+    if (i == num_pids) {
+        fprintf(stderr, "%s - no such process %ld\n", __FUNCTION__, pid);
+        free(pids);
+        free(ppids);
+        return -1;
+    }
+
+    for (i = 0; i < num_tree; i++) {
+        for (j = num_tree; j < num_pids; j++) {
+            if (ppids[j] != pids[i])
+                continue;
+            long tp = pids[j], tpp = ppids[j];
+            pids[j] = pids[num_tree];
+            ppids[j] = ppids[num_tree];
+            pids[num_tree] = tp;
+            ppids[num_tree++] = tpp;
+        }
+    }
+
+    ret = ptsname_list_pids(pids, num_tree, entries, num_entries);
+
+    free(pids);
+    free(ppids);
+
+    return ret;
+}
+
+int ptsname_list_all(long pid, int **pts_ids, int *num_ids) {
+    struct ptsname_entry *entries = NULL;
+    int num_entries = 0;
+    int ret;
+    int i;
+
+    if(!pts_ids || !num_ids){
+        fprintf(stderr, "%s - invalid params: pts_ids & num_ids must not be"
+                " NULL\n", __FUNCTION__);
+        return -1;
+    }
+
+    ret = ptsname_list_pids(&pid, 1, &entries, &num_entries);
+
+    *pts_ids = calloc(num_entries ? num_entries : 1, sizeof(int));
+    if (!*pts_ids) {
+        free(entries);
         return -1;
     }
 
-    child = mytrace_fork(parent);
+    for (i = 0; i < num_entries; i++) {
+        (*pts_ids)[*num_ids] = entries[i].pts;
+        *num_ids += 1;
+    }
+    free(entries);
+
+    return ret;
+}
 
-    snprintf(fdstr, sizeof(fdstr), "/proc/%ld/fd", pid);
+/* fd of pid by way of the program's own answer, where that is certain */
+static int probe_fd(long pid, int fd, int *pts_id) {
+    struct ptsname_probe_pty *ptys;
+    struct pts_candidates cs = { 0 };
+    int ret = -1;
+    int num;
+
+    ptys = malloc(PROBE_MAX_PTYS * sizeof(*ptys));
+    if (!ptys)
+        return -1;
+    num = ptsname_probe(pid, ptys, PROBE_MAX_PTYS, NULL);
+
+    if (num > 0 && collect_table(pid, pid, &cs) == 0) {
+        group_candidates(&cs);
+        resolve_untouched(&cs);
+        probe_candidates(pid, &cs, ptys, num);
+        for (int i = 0; i < cs.num; i++) {
+            struct pts_candidate *r = &cs.c[cs.c[i].rep];
+
+            if (cs.c[i].fd == fd && r->tried && r->pts >= 0) {
+                *pts_id = r->pts;
+                ret = 0;
+            }
+        }
+    }
+    candidates_free(&cs);
+    free(ptys);
+
+    return ret;
+}
+
+int ptsname_by_fd(long pid, int target_fd, int *pts_id) {
+    char fdstr[1024];
+    struct mytrace trace;
+    int ret = 0;
+    struct statx stx;
+    struct ptsname_gen gen;
+    unsigned long long start_time;
+    int pts_number = -1;
+    int local_fd = -1;
+    int mnt_id = -1;
 
     /* Inspect requested file descriptor, ensuring it is a PTY */
     snprintf(fdstr, sizeof(fdstr), "/proc/%ld/fd/%d", pid, target_fd);
 
-    if (lstat(fdstr, &stat_buf) < 0){
-        ret = -1;
-        goto wrap_up;
+    if (!is_ptmx(fdstr, &stx))
+        return -1;
+
+    if (fdinfo_ids(pid, pid, target_fd, &pts_number, &mnt_id) == 0
+        && pts_number >= 0) {
+        *pts_id = pts_number;
+        return 0;
+    }
+
+    /* asked before, and this is still the same fd */
+    if (ptsname_start_time(pid, &start_time) < 0)
+        return -1;
+    fd_gen(&stx, start_time, mnt_id, &gen);
+    if (ptsname_cache_get(pid, target_fd, &gen, pts_id) == 0)
+        return 0;
+
+    /* a resident agent answers without stopping anything */
+    if (ptmx_agent_TIOCGPTN(pid, target_fd, pts_id) == 0) {
+        ptsname_cache_put(pid, target_fd, &gen, *pts_id);
+        return 0;
     }
 
-    int rlnk = readlink(fdstr, linkname, PATH_MAX);
-    linkname[PATH_MAX-1] = '\0';
+    /* or the program knows, and says so unambiguously */
+    if (probe_fd(pid, target_fd, pts_id) == 0) {
+        ptsname_cache_put(pid, target_fd, &gen, *pts_id);
+        return 0;
+    }
 
-    //if (!S_ISCHR(stat_buf.st_mode)
-    //    || MAJOR(stat_buf.st_rdev) != UNIX98_PTY_SLAVE_MAJOR)
-    //    continue;
+    /* then a local copy of the fd, so the ioctl runs here */
+    if (ptsname_grab_fds(pid, pid, &target_fd, 1, &local_fd) == 0
+        && local_fd >= 0) {
+        ret = ioctl(local_fd, TIOCGPTN, &pts_number);
+        close(local_fd);
+        if (ret == 0) {
+            *pts_id = pts_number;
+            ptsname_cache_put(pid, target_fd, &gen, pts_number);
+            return 0;
+        }
+    }
 
-    if(!linkname || !strstr("/dev/ptmx", linkname) || strlen(linkname) == 0) {
-        ret = -1;
-        goto wrap_up;
+    if (mytrace_attach(&trace, pid) < 0) {
+        fprintf(stderr, "%s - cannot access process %ld\n", __FUNCTION__, pid);
+        return -1;
     }
 
-    debug("found %s for %d for pid %li\n", linkname, target_fd, pid);
+    debug("found ptmx for %d for pid %li\n", target_fd, pid);
 
-    ret = mytrace_TIOCGPTN(child, target_fd, &pts_number);
+    ret = mytrace_TIOCGPTN(&trace, target_fd, &pts_number);
     if (ret < 0) {
         perror("mytrace_TIOCGPTN");
     } else {
         *pts_id = pts_number;
+        ptsname_cache_put(pid, target_fd, &gen, pts_number);
     }
 
-wrap_up:
-    mytrace_detach(parent);
+    mytrace_detach(&trace);
     waitpid(pid, NULL, 0);      
 
     return ret; 
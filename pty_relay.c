@@ -0,0 +1,306 @@
+/*
+ * Copyright 2013
+ *  Steven Maresca <steve@zentific.com>
+ *  Zentific LLC
+ *
+ * pty_relay:
+ *  Attach to a resolved /dev/pts/$PTS slave and relay it to stdio or to
+ *  a single client of a listening unix socket, without screen/minicom.
+ *
+ *  Bytes are moved with splice() through a pipe per direction so they
+ *  never cross into user space. Descriptors that cannot be spliced
+ *  (older kernels did not implement splice for ttys) fall back to a
+ *  plain read()/write() copy for that direction only.
+ *
+ *  When stdin is a terminal it is put in raw mode too, so keystrokes
+ *  (^C and ^Z included) go to the remote side unechoed and unbuffered;
+ *  that direction is copied so ^] can be seen, and ends the session.
+ */
+
+#define _GNU_SOURCE             /* splice() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include "ptmx_resolve.h"
+
+#define RELAY_CHUNK  65536
+#define RELAY_ESCAPE 0x1d       /* ^], as telnet */
+
+struct relay_dir {
+    int src, dst;
+    int pipe[2];
+    size_t pending;         /* bytes parked in pipe, not yet at dst */
+    int copy;               /* splice unsupported: read()/write() instead */
+    int done;               /* src reached EOF */
+    int escape;             /* byte that ends the session, or -1 */
+};
+
+static volatile sig_atomic_t relay_stop = 0;
+
+static void relay_sighandler(int sig) {
+    (void)sig;
+    relay_stop = 1;
+}
+
+static int relay_dir_init(struct relay_dir *d, int src, int dst) {
+    memset(d, 0, sizeof(*d));
+    d->src = src;
+    d->dst = dst;
+    d->escape = -1;
+
+    if (pipe2(d->pipe, O_CLOEXEC) < 0) {
+        perror("pipe2");
+        return -1;
+    }
+    /* a larger pipe means fewer round trips at high line rates */
+    fcntl(d->pipe[1], F_SETPIPE_SZ, RELAY_CHUNK);
+
+    return 0;
+}
+
+static void relay_dir_fini(struct relay_dir *d) {
+    close(d->pipe[0]);
+    close(d->pipe[1]);
+}
+
+/* returns 0 on progress, 1 on EOF/hangup of src or dst, 2 on the escape
+ * byte, -1 on error */
+static int relay_dir_pump(struct relay_dir *d) {
+    char buf[4096];
+    ssize_t n;
+
+    if (d->copy) {
+        n = read(d->src, buf, sizeof(buf));
+        if (n == 0 || (n < 0 && errno == EIO))
+            return 1;
+        if (n < 0)
+            return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        if (d->escape >= 0) {
+            char *esc = memchr(buf, d->escape, n);
+
+            if (esc) {
+                /* what was typed before it still goes through */
+                if (esc > buf && write(d->dst, buf, esc - buf) < 0)
+                    return -1;
+                return 2;
+            }
+        }
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = write(d->dst, buf + off, n - off);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w < 0)
+                return (errno == EPIPE) ? 1 : -1;
+            off += w;
+        }
+        return 0;
+    }
+
+    if (d->pending == 0) {
+        n = splice(d->src, NULL, d->pipe[1], NULL, RELAY_CHUNK,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0 || (n < 0 && errno == EIO))
+            return 1;
+        if (n < 0 && errno == EINVAL) {
+            debug("splice unsupported for fd %d, copying instead", d->src);
+            d->copy = 1;
+            return 0;
+        }
+        if (n < 0)
+            return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        d->pending = n;
+        return 0;
+    }
+
+    n = splice(d->pipe[0], NULL, d->dst, NULL, d->pending,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0 && errno == EINVAL) {
+        /* dst cannot be spliced to: drain what is parked in the pipe */
+        while (d->pending) {
+            ssize_t r = read(d->pipe[0], buf, d->pending < sizeof(buf) ?
+                             d->pending : sizeof(buf));
+            if (r <= 0 || write(d->dst, buf, r) != r)
+                return -1;
+            d->pending -= r;
+        }
+        d->copy = 1;
+        return 0;
+    }
+    if (n < 0)
+        return (errno == EPIPE) ? 1 :
+               (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    d->pending -= n;
+
+    return 0;
+}
+
+static int relay_loop(int pty, int in, int out, int escape) {
+    struct relay_dir dirs[2];
+    struct pollfd pfd[2];
+    int quit = 0;
+    int ret = 0;
+
+    if (relay_dir_init(&dirs[0], pty, out) < 0)
+        return -1;
+    if (relay_dir_init(&dirs[1], in, pty) < 0) {
+        relay_dir_fini(&dirs[0]);
+        return -1;
+    }
+    if (escape >= 0) {
+        dirs[1].escape = escape;
+        dirs[1].copy = 1;
+    }
+
+    while (!relay_stop && !quit && ret == 0) {
+        /* wait on the source while the pipe is empty, on the sink while
+         * it still holds data, so neither direction can starve the other */
+        for (int i = 0; i < 2; i++) {
+            if (dirs[i].done) {
+                pfd[i].fd = -1;
+            } else if (dirs[i].pending) {
+                pfd[i].fd = dirs[i].dst;
+                pfd[i].events = POLLOUT;
+            } else {
+                pfd[i].fd = dirs[i].src;
+                pfd[i].events = POLLIN;
+            }
+            pfd[i].revents = 0;
+        }
+
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            ret = -1;
+            break;
+        }
+
+        for (int i = 0; i < 2 && ret == 0; i++) {
+            if (!pfd[i].revents)
+                continue;
+            ret = relay_dir_pump(&dirs[i]);
+            if (ret == 2) {
+                quit = 1;
+                ret = 0;
+            }
+            /* EOF on stdin (e.g. </dev/null) still leaves output worth
+             * relaying; a socket client going away ends the session */
+            if (ret == 1 && i == 1 && in != out) {
+                dirs[i].done = 1;
+                ret = 0;
+            }
+        }
+    }
+
+    relay_dir_fini(&dirs[0]);
+    relay_dir_fini(&dirs[1]);
+
+    return ret < 0 ? -1 : 0;
+}
+
+static int relay_accept(char const *sock_path) {
+    struct sockaddr_un addr;
+    int lfd, cfd;
+
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s - socket path too long: %s\n", __FUNCTION__,
+                sock_path);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sock_path);
+
+    lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    unlink(sock_path);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(lfd, 1) < 0) {
+        perror(sock_path);
+        close(lfd);
+        return -1;
+    }
+
+    do {
+        cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+    } while (cfd < 0 && errno == EINTR && !relay_stop);
+
+    close(lfd);
+    unlink(sock_path);
+
+    return cfd;
+}
+
+int ptmx_relay(char const *pts_path, char const *sock_path) {
+    struct termios saved, saved_in, raw;
+    struct sigaction sa;
+    int pty, client = -1;
+    int have_termios = 0, have_termios_in = 0;
+    int ret = -1;
+
+    pty = open(pts_path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (pty < 0) {
+        perror(pts_path);
+        return -1;
+    }
+
+    if (tcgetattr(pty, &saved) == 0) {
+        raw = saved;
+        cfmakeraw(&raw);
+        if (tcsetattr(pty, TCSANOW, &raw) == 0)
+            have_termios = 1;
+    }
+
+    /* no SA_RESTART: let poll()/accept() return so termios gets restored */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = relay_sighandler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (sock_path) {
+        client = relay_accept(sock_path);
+        if (client < 0)
+            goto wrap_up;
+        ret = relay_loop(pty, client, client, -1);
+        close(client);
+    } else {
+        if (isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &saved_in) == 0) {
+            raw = saved_in;
+            cfmakeraw(&raw);
+            fprintf(stderr, "Connected to %s. Escape character is '^]'.\n",
+                    pts_path);
+            if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == 0)
+                have_termios_in = 1;
+        }
+        ret = relay_loop(pty, STDIN_FILENO, STDOUT_FILENO,
+                         have_termios_in ? RELAY_ESCAPE : -1);
+    }
+
+wrap_up:
+    /* every way out (EOF, ^], SIGINT/SIGTERM/SIGHUP, error) ends here */
+    if (have_termios_in)
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_in);
+    if (have_termios)
+        tcsetattr(pty, TCSANOW, &saved);
+    close(pty);
+
+    return ret;
+}
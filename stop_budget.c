@@ -0,0 +1,385 @@
+/*
+ * Copyright 2013
+ *  Steven Maresca <steve@zentific.com>
+ *  Zentific LLC
+ *
+ * stop_budget:
+ *  Pacing for ptrace stops, so that resolving a whole host does not stall
+ *  every guest on it at the same moment.
+ *
+ *  mytrace_attach() asks for admission before stopping anything and
+ *  mytrace_detach() hands the slot back. Admission holds while fewer than
+ *  max_stopped tracees are stopped, no waiter of a more important class is
+ *  queued for a slot, and the target's stop time in the current window plus
+ *  what its next stop is expected to cost stays within budget_usec. A
+ *  waiter held up by its own target's budget holds nobody else back: one
+ *  guest over budget must not stall the rest of the host. Expectations
+ *  come from measurement: every injected syscall is charged as it
+ *  completes, and whole stops feed a running average per target.
+ *
+ *  Without ptsname_budget_set() nothing is paced, as before.
+ */
+
+#define _GNU_SOURCE             /* pthread_condattr_setclock() */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ptmx_resolve.h"
+
+#define BUDGET_SLOTS 1024       /* targets tracked at once, power of two */
+#define NUM_CLASSES  3
+
+struct budget_target {
+    long tgid;                  /* 0: free */
+    int stopped;                /* tasks of it stopped right now */
+    uint64_t window_start;      /* usec, CLOCK_MONOTONIC */
+    long spent;                 /* stop time charged in this window */
+    long estimate;              /* running average cost of one stop */
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int enabled;
+    struct ptsname_budget cfg;
+    int stopped;
+    int waiting[NUM_CLASSES];   /* only those waiting for a slot */
+    long estimate;              /* same, over all targets */
+    struct budget_target t[BUDGET_SLOTS];
+} budget = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t now_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* a target stops being tracked once nothing of it is stopped and its
+ * window ran out; caller holds the lock */
+static struct budget_target *budget_find(long tgid, int claim) {
+    uint64_t now = now_usec();
+    struct budget_target *free_slot = NULL;
+    unsigned int h = (unsigned int)tgid * 2654435761u;
+
+    for (int i = 0; i < BUDGET_SLOTS; i++) {
+        struct budget_target *t = &budget.t[(h + i) & (BUDGET_SLOTS - 1)];
+
+        if (t->tgid == tgid)
+            return t;
+        if (!free_slot && (!t->tgid || (!t->stopped
+                && now - t->window_start >= (uint64_t)budget.cfg.window_usec)))
+            free_slot = t;
+        if (!t->tgid)
+            break;
+    }
+
+    if (!claim || !free_slot)
+        return NULL;
+
+    memset(free_slot, 0, sizeof(*free_slot));
+    free_slot->tgid = tgid;
+    free_slot->window_start = now;
+
+    return free_slot;
+}
+
+static long proc_tgid(long tid) {
+    char path[64], buf[1024];
+    long long tgid;
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%ld/status", tid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return tid;
+    n = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (n <= 0)
+        return tid;
+
+    tgid = proc_key_num(buf, n, "Tgid:");
+
+    return tgid > 0 ? tgid : tid;
+}
+
+int ptsname_class(long pid) {
+    char path[64], buf[1024], exe[PATH_MAX];
+    int const fields[2] = { 19, 41 };   /* nice, policy */
+    long long vals[2] = { 0, SCHED_OTHER };
+    int nice, policy;
+    char *base;
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return PTSNAME_CLASS_NORMAL;
+    n = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (n <= 0)
+        return PTSNAME_CLASS_NORMAL;
+
+    proc_stat_fields(buf, n, fields, 2, vals);
+    nice = vals[0];
+    policy = vals[1];
+
+    /* virtual machines: every stop is felt by a guest */
+    snprintf(path, sizeof(path), "/proc/%ld/exe", pid);
+    n = readlink(path, exe, sizeof(exe) - 1);
+    if (n > 0) {
+        exe[n] = '\0';
+        base = strrchr(exe, '/');
+        base = base ? base + 1 : exe;
+        if (!strncmp(base, "qemu", 4) || !strncmp(base, "kvm", 3))
+            return PTSNAME_CLASS_LATENCY;
+    }
+
+    if (policy == SCHED_FIFO || policy == SCHED_RR)
+        return PTSNAME_CLASS_LATENCY;
+    if (nice > 0 || policy == SCHED_BATCH || policy == SCHED_IDLE)
+        return PTSNAME_CLASS_BATCH;
+
+    return PTSNAME_CLASS_NORMAL;
+}
+
+void ptsname_budget_set(struct ptsname_budget const *cfg) {
+    pthread_condattr_t attr;
+    static int cond_ready = 0;
+
+    pthread_mutex_lock(&budget.lock);
+    if (!cond_ready) {
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&budget.cond, &attr);
+        pthread_condattr_destroy(&attr);
+        cond_ready = 1;
+    }
+
+    budget.enabled = cfg != NULL;
+    if (cfg) {
+        budget.cfg = *cfg;
+        if (budget.cfg.max_stopped <= 0)
+            budget.cfg.max_stopped = 1;
+        if (budget.cfg.window_usec <= 0)
+            budget.cfg.window_usec = 1000000;
+    }
+    pthread_cond_broadcast(&budget.cond);
+    pthread_mutex_unlock(&budget.lock);
+}
+
+/* would t's own budget let another stop of it through */
+static int budget_within(struct budget_target *t) {
+    long expect = t->estimate ? t->estimate : budget.estimate;
+
+    /* a target always gets its first stop of a window, however costly */
+    return t->spent == 0 || budget.cfg.budget_usec <= 0
+        || t->spent + expect <= budget.cfg.budget_usec;
+}
+
+/* is there a slot for class cls, with no more important waiter first */
+static int budget_slot(int cls) {
+    if (budget.stopped >= budget.cfg.max_stopped)
+        return 0;
+    for (int c = 0; c < cls; c++) {
+        if (budget.waiting[c])
+            return 0;
+    }
+
+    return 1;
+}
+
+long ptsname_budget_enter(long tid) {
+    struct budget_target *t;
+    struct timespec until;
+    uint64_t now, wake;
+    long tgid;
+    int cls, within, queued = 0;
+
+    if (!budget.enabled)
+        return 0;
+
+    tgid = proc_tgid(tid);
+    cls = ptsname_class(tgid);
+
+    pthread_mutex_lock(&budget.lock);
+
+    for (;;) {
+        t = budget_find(tgid, 1);
+        now = now_usec();
+
+        if (t && now - t->window_start >= (uint64_t)budget.cfg.window_usec) {
+            t->window_start = now;
+            t->spent = 0;
+        }
+
+        /* only a waiter its own budget would admit is queued for a slot */
+        within = t && budget_within(t);
+        if (within != queued) {
+            budget.waiting[cls] += within ? 1 : -1;
+            queued = within;
+            /* lower classes it held back may go now */
+            if (!within)
+                pthread_cond_broadcast(&budget.cond);
+        }
+        if (within && budget_slot(cls))
+            break;
+
+        /* over budget: nothing changes before the window turns over;
+         * waiting for a slot, a release wakes us before the timeout */
+        wake = t && !within ? t->window_start + budget.cfg.window_usec
+                            : now + budget.cfg.window_usec;
+        until.tv_sec = wake / 1000000;
+        until.tv_nsec = wake % 1000000 * 1000;
+        pthread_cond_timedwait(&budget.cond, &budget.lock, &until);
+    }
+
+    budget.waiting[cls]--;
+    budget.stopped++;
+    t->stopped++;
+    pthread_mutex_unlock(&budget.lock);
+
+    debug("budget: stopping %ld (class %d, %ld/%ld usec spent)", tid, cls,
+          t->spent, budget.cfg.budget_usec);
+
+    /* later waiters of a lower class may have been held back by us */
+    pthread_cond_broadcast(&budget.cond);
+
+    return tgid;
+}
+
+void ptsname_budget_charge(long tgid, long usec) {
+    struct budget_target *t;
+
+    if (tgid <= 0)
+        return;
+
+    pthread_mutex_lock(&budget.lock);
+    t = budget_find(tgid, 0);
+    if (t)
+        t->spent += usec;
+    pthread_mutex_unlock(&budget.lock);
+}
+
+void ptsname_budget_leave(long tgid, long uncharged, long total) {
+    struct budget_target *t;
+
+    if (tgid <= 0)
+        return;
+
+    pthread_mutex_lock(&budget.lock);
+    budget.stopped--;
+    t = budget_find(tgid, 0);
+    if (t) {
+        t->stopped--;
+        t->spent += uncharged;
+        t->estimate = t->estimate ? (3 * t->estimate + total) / 4 : total;
+    }
+    budget.estimate = budget.estimate ? (7 * budget.estimate + total) / 8
+                                      : total;
+    pthread_cond_broadcast(&budget.cond);
+    pthread_mutex_unlock(&budget.lock);
+
+    debug("budget: released %ld after %ld usec", tgid, total);
+}
+
+static int entry_cmp(const void *a, const void *b) {
+    struct ptsname_entry const *ea = a, *eb = b;
+
+    if (ea->pid != eb->pid)
+        return (ea->pid > eb->pid) - (ea->pid < eb->pid);
+
+    return ea->fd - eb->fd;
+}
+
+int ptsname_list_host(struct ptsname_budget const *cfg,
+                      struct ptsname_entry **entries, int *num_entries) {
+    struct ptsname_entry *known = NULL, *found = NULL, *all;
+    struct dirent *de;
+    int num_known = 0, num_found = 0, max_pids = 0, num_pids = 0;
+    int num_workers, ret;
+    long self = getpid();
+    long *pids = NULL;
+    DIR *proc;
+
+    *entries = NULL;
+    *num_entries = 0;
+
+    proc = opendir("/proc");
+    if (!proc) {
+        perror("/proc");
+        return -1;
+    }
+    while ((de = readdir(proc))) {
+        char *end;
+        long pid = strtol(de->d_name, &end, 10);
+
+        if (*end || end == de->d_name || pid == self)
+            continue;
+        if (num_pids == max_pids) {
+            long *tmp;
+
+            max_pids = max_pids ? 2 * max_pids : 1024;
+            tmp = realloc(pids, max_pids * sizeof(*tmp));
+            if (!tmp) {
+                closedir(proc);
+                free(pids);
+                return -1;
+            }
+            pids = tmp;
+        }
+        pids[num_pids++] = pid;
+    }
+    closedir(proc);
+
+    /* batched: drops processes without masters, answers what fdinfo can */
+    if (ptsname_host_prefilter(pids, &num_pids, &known, &num_known) < 0) {
+        free(pids);
+        return -1;
+    }
+
+    ptsname_budget_set(cfg);
+
+    /*
+     * The rest is grouped host-wide first, so a master inherited by many
+     * processes is resolved (and its owner stopped) once. Twice the stop
+     * slots in workers, so fd copies go on while K tracees are held.
+     */
+    num_workers = cfg ? 2 * budget.cfg.max_stopped : 1;
+    ret = num_pids ? ptsname_list_pids_pooled(pids, num_pids, num_workers,
+                                              &found, &num_found) : -1;
+    free(pids);
+
+    ptsname_budget_set(NULL);
+
+    all = realloc(known, (num_known + num_found + 1) * sizeof(*all));
+    if (!all) {
+        free(known);
+        free(found);
+        return -1;
+    }
+    if (num_found)
+        memcpy(all + num_known, found, num_found * sizeof(*all));
+    free(found);
+    if (num_known)
+        ret = 0;
+
+    qsort(all, num_known + num_found, sizeof(*all), entry_cmp);
+    *entries = all;
+    *num_entries = num_known + num_found;
+
+    return ret;
+}